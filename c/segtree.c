@@ -6,8 +6,19 @@
  *  sort of emulate modules is through different files, but we don't
  *  really have that liberty in 15-451, so this will have to do.
  *  Implements the segtree described in the lectures notes.
+ *  Below the int tree is an allocation-free generic interface: any element
+ *  type through a combine function pointer (GenericSegTree) or a typed,
+ *  inlinable instantiation (DEFINE_SEGTREE), both over a caller buffer.
+ *  Build with -DSEGTREE_BENCHMARK for the benchmark harness at the end of
+ *  the file, the C twin of cpp/segtree_bench.h:
+ *    gcc -std=c11 -O2 -DSEGTREE_BENCHMARK segtree.c -lm
+ *    ./a.out [max log2 size] [ops per cell]
  */ 
 
+#ifdef SEGTREE_BENCHMARK
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -101,6 +112,323 @@ int RangeSum(SegTree *s, size_t i, size_t j) {
 
 /******************** INTERFACE FUNCTIONS END ********************/
 
+/******************** GENERIC INTERFACE BEGIN ********************/
+// The same tree over any element type, for programs that cannot allocate
+// at runtime: nothing below calls malloc, the caller hands in a buffer of
+// SegTreeNodes(n) elements and keeps it alive as long as the tree. Two
+// flavours share the layout of SegTree (root at 1, leaf k at N+k):
+//   GenericSegTree      elements of any size, combined through a function
+//                       pointer, so one compiled copy serves every type
+//   DEFINE_SEGTREE(...) a typed instantiation whose combine is visible to
+//                       the compiler and gets inlined, for the hot path
+// Both have a bulk Build in O(n) and an iterative RangeSum that walks up
+// from the two leaf ends instead of recursing from the root.
+#include <string.h>
+
+// Number of elements the buffer of a tree over n leaves must hold.
+size_t SegTreeNodes(size_t n) {return 2 * SuperCeiling(n);}
+
+// Writes combine(a, b) to out. out may be the same object as a but never
+// the same as b; combine must be associative with identity as its unit.
+typedef void (*SegTreeCombine)(void *out, const void *a, const void *b);
+
+typedef struct GenericSegTree {
+    size_t n;
+    size_t N;
+    size_t size;               // bytes per element
+    SegTreeCombine combine;
+    const void *identity;      // must outlive the tree
+    unsigned char *A;          // SegTreeNodes(n) * size bytes, caller owned
+} GenericSegTree;
+
+static void *GenericNode(const GenericSegTree *s, size_t v) {return s->A + v * s->size;}
+
+// Sets every node to the identity. buffer must hold SegTreeNodes(n)
+// elements of size bytes each, suitably aligned for the element type.
+void GenericSegTreeInit(GenericSegTree *s, size_t n, size_t size, SegTreeCombine combine,
+                        const void *identity, void *buffer) {
+    s->n = n;
+    s->N = SuperCeiling(n);
+    s->size = size;
+    s->combine = combine;
+    s->identity = identity;
+    s->A = buffer;
+    for (size_t v = 0; v < 2 * s->N; v++) memcpy(GenericNode(s, v), identity, size);
+}
+
+// Copies the n elements at leaves into the tree and recomputes every
+// internal node bottom up, in O(n) rather than the O(n log n) of n Assigns.
+void GenericSegTreeBuild(GenericSegTree *s, const void *leaves) {
+    memcpy(GenericNode(s, s->N), leaves, s->n * s->size);
+    for (size_t v = s->N + s->n; v < 2 * s->N; v++) {
+        memcpy(GenericNode(s, v), s->identity, s->size);
+    }
+    for (size_t v = s->N - 1; v > 0; v--) {
+        s->combine(GenericNode(s, v), GenericNode(s, LeftChild(v)), GenericNode(s, RightChild(v)));
+    }
+}
+
+// Assign for GenericSegTree; copies size bytes from x to leaf i.
+void GenericSegTreeAssign(GenericSegTree *s, size_t i, const void *x) {
+    i = i+s->N;
+    memcpy(GenericNode(s, i), x, s->size);
+    for (i = Parent(i); i>0; i = Parent(i)) {
+        s->combine(GenericNode(s, i), GenericNode(s, LeftChild(i)), GenericNode(s, RightChild(i)));
+    }
+}
+
+// Writes sum_{i <= k <= j} A[k] to out. Climbs from leaves i and j at
+// once: a left end that is a right child is folded into out immediately,
+// a right end that is a left child is remembered, and the remembered
+// nodes are folded in on the way back so that out only ever grows on its
+// right and the combine need not be commutative. At most one node per
+// level is remembered, so the stack is bounded by the bits in a size_t.
+void GenericSegTreeRangeSum(const GenericSegTree *s, size_t i, size_t j, void *out) {
+    size_t right[8 * sizeof(size_t)];
+    size_t depth = 0;
+    memcpy(out, s->identity, s->size);
+    for (size_t l = i + s->N, r = j + s->N + 1; l < r; l = Parent(l), r = Parent(r)) {
+        if (l & 1) s->combine(out, out, GenericNode(s, l++));
+        if (r & 1) right[depth++] = --r;
+    }
+    while (depth > 0) s->combine(out, out, GenericNode(s, right[--depth]));
+}
+
+// Defines struct Name over elements of type T together with NameInit,
+// NameBuild, NameAssign and NameRangeSum, the typed counterparts of the
+// GenericSegTree functions. combine(a, b) is any function or macro that
+// returns the glue of two T values and identity is an expression for its
+// unit, e.g. DEFINE_SEGTREE(IntSegTree, int, glue, 0). Everything is
+// static inline, so instantiate it once per type in each file that uses it.
+#define DEFINE_SEGTREE(Name, T, combine, identity)                              \
+typedef struct Name {                                                           \
+    size_t n;                                                                   \
+    size_t N;                                                                   \
+    T *A;                                                                       \
+} Name;                                                                         \
+                                                                                \
+static inline void Name##Init(Name *s, size_t n, T *buffer) {                   \
+    s->n = n;                                                                   \
+    s->N = SuperCeiling(n);                                                     \
+    s->A = buffer;                                                              \
+    for (size_t v = 0; v < 2 * s->N; v++) s->A[v] = (identity);                 \
+}                                                                               \
+                                                                                \
+static inline void Name##Build(Name *s, const T *leaves) {                      \
+    for (size_t k = 0; k < s->n; k++) s->A[s->N + k] = leaves[k];               \
+    for (size_t v = s->N + s->n; v < 2 * s->N; v++) s->A[v] = (identity);       \
+    for (size_t v = s->N - 1; v > 0; v--) {                                     \
+        s->A[v] = combine(s->A[LeftChild(v)], s->A[RightChild(v)]);             \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+static inline void Name##Assign(Name *s, size_t i, T x) {                       \
+    i = i+s->N;                                                                 \
+    s->A[i] = x;                                                                \
+    for (i = Parent(i); i>0; i = Parent(i)) {                                   \
+        s->A[i] = combine(s->A[LeftChild(i)], s->A[RightChild(i)]);             \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+/* With values held by copy a right accumulator replaces the stack of */        \
+/* GenericSegTreeRangeSum: left grows on its right, acc on its left.  */        \
+static inline T Name##RangeSum(const Name *s, size_t i, size_t j) {             \
+    T left = (identity), acc = (identity);                                      \
+    size_t l, r;                                                                \
+    for (l = i + s->N, r = j + s->N + 1; l < r; l = Parent(l), r = Parent(r)) { \
+        if (l & 1) left = combine(left, s->A[l++]);                             \
+        if (r & 1) acc = combine(s->A[--r], acc);                               \
+    }                                                                           \
+    return combine(left, acc);                                                  \
+}
+
+// The int tree of this file, instantiated generically.
+DEFINE_SEGTREE(IntSegTree, int, glue, 0)
+
+/******************** GENERIC INTERFACE END ********************/
+
+#ifdef SEGTREE_BENCHMARK
+/**** BENCHMARK ****/
+// Same grid as cpp/segtree_bench.h: sizes whose 2N node array fits L1,
+// L2, L3 or only DRAM, uniform, Zipf and sequential access, and latency
+// percentiles over batches of BENCH_BATCH operations.
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_BATCH 32
+
+enum { UNIFORM, ZIPF, SEQUENTIAL };
+static const char *access_names[] = {"uniform", "zipf", "sequential"};
+
+static volatile long long bench_sink;
+
+static double Now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+// xorshift64*, so runs are reproducible without depending on rand()
+static uint64_t Random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Fills idx with count indices in [0,n) drawn from the access pattern.
+static void Indices(int access, size_t n, size_t count, uint64_t seed, size_t *idx) {
+    uint64_t state = seed | 1;
+    for (size_t k = 0; k < count; k++) {
+        if (access == SEQUENTIAL) {
+            idx[k] = k % n;
+        } else if (access == ZIPF) {
+            double u = (Random(&state) >> 11) * (1.0 / 9007199254740992.0);
+            size_t rank = (size_t) exp(u * log((double) n + 1)) - 1;
+            idx[k] = (min(rank, n-1) * 0x9E3779B97F4A7C15ULL) % n;
+        } else {
+            idx[k] = Random(&state) % n;
+        }
+    }
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Prints throughput and percentiles of per-batch latencies held in batches.
+static void Report(const char *name, const char *op, const char *access, size_t n,
+                   size_t count, double *batches, size_t nbatches, double total) {
+    qsort(batches, nbatches, sizeof(double), CompareDoubles);
+    printf("%-22s %-8s %-10s n=%-9zu %8.2f Mops/s  p50 %7.1f  p90 %7.1f  p99 %7.1f ns\n",
+           name, op, access, n, count / total * 1e3,
+           batches[(size_t) (0.50 * (nbatches-1))], batches[(size_t) (0.90 * (nbatches-1))],
+           batches[(size_t) (0.99 * (nbatches-1))]);
+}
+
+// One tree variant behind function pointers, so both share the loops
+// below. The indirect call is a few ns on top of every operation, the
+// same for each variant.
+typedef struct BenchTree {
+    const char *name;
+    void (*build)(size_t n);   // replaces the tree by one over n ones
+    void (*assign)(size_t i, int x);
+    int (*range_sum)(size_t i, size_t j);
+    void (*destroy)(void);
+} BenchTree;
+
+static SegTree bench_segtree;
+
+// There is no bulk constructor, so build times n calls to Assign.
+static void SegTreeBench_Build(size_t n) {
+    SegTreeInit(&bench_segtree, n);
+    for (size_t k = 0; k < n; k++) Assign(&bench_segtree, k, 1);
+}
+static void SegTreeBench_Assign(size_t i, int x) {Assign(&bench_segtree, i, x);}
+static int SegTreeBench_RangeSum(size_t i, size_t j) {return RangeSum(&bench_segtree, i, j);}
+static void SegTreeBench_Destroy(void) {SegTreeDestroy(&bench_segtree);}
+
+// The benchmark owns the buffers; the tree itself never allocates.
+static IntSegTree bench_int;
+static int *bench_int_buffer, *bench_int_leaves;
+
+static void IntSegTreeBench_Build(size_t n) {
+    bench_int_buffer = malloc(sizeof(int) * SegTreeNodes(n));
+    bench_int_leaves = malloc(sizeof(int) * n);
+    for (size_t k = 0; k < n; k++) bench_int_leaves[k] = 1;
+    IntSegTreeInit(&bench_int, n, bench_int_buffer);
+    IntSegTreeBuild(&bench_int, bench_int_leaves);
+}
+static void IntSegTreeBench_Assign(size_t i, int x) {IntSegTreeAssign(&bench_int, i, x);}
+static int IntSegTreeBench_RangeSum(size_t i, size_t j) {
+    return IntSegTreeRangeSum(&bench_int, i, j);
+}
+static void IntSegTreeBench_Destroy(void) {
+    free(bench_int_buffer);
+    free(bench_int_leaves);
+}
+
+static const BenchTree bench_trees[] = {
+    {"SegTree", SegTreeBench_Build, SegTreeBench_Assign, SegTreeBench_RangeSum,
+     SegTreeBench_Destroy},
+    {"IntSegTree", IntSegTreeBench_Build, IntSegTreeBench_Assign, IntSegTreeBench_RangeSum,
+     IntSegTreeBench_Destroy},
+};
+
+// Runs the whole grid for one tree; idx, len and batches are scratch
+// arrays sized for ops operations.
+static void BenchGrid(const BenchTree *tree, size_t max_log, size_t ops, size_t *idx,
+                      size_t *len, double *batches) {
+    size_t logs[] = {11, 15, 19, 23};
+    for (size_t l = 0; l < sizeof(logs) / sizeof(logs[0]); l++) {
+        if (logs[l] > max_log) break;
+        size_t n = (size_t) 1 << logs[l];
+
+        size_t builds = max(1, ops / n);
+        double start = Now();
+        for (size_t b = 0; b < builds; b++) {
+            tree->build(n);
+            bench_sink += tree->range_sum(0, n-1);
+            tree->destroy();
+        }
+        printf("%-22s %-8s %-10s n=%-9zu %8.2f ns/leaf\n", tree->name, "build", "-", n,
+               (Now() - start) / builds / n);
+
+        tree->build(n);
+        for (int access = UNIFORM; access <= SEQUENTIAL; access++) {
+            Indices(access, n, ops, n, idx);
+            Indices(UNIFORM, n, ops, n+1, len);
+            size_t nbatches = 0;
+            double total = 0;
+            for (size_t k = 0; k < ops; k += BENCH_BATCH) {
+                size_t end = min(ops, k + BENCH_BATCH);
+                double t = Now();
+                for (size_t q = k; q < end; q++) tree->assign(idx[q], (int) q);
+                t = Now() - t;
+                total += t;
+                batches[nbatches++] = t / (end - k);
+            }
+            Report(tree->name, "assign", access_names[access], n, ops, batches, nbatches, total);
+
+            long long sum = 0;
+            nbatches = 0;
+            total = 0;
+            for (size_t k = 0; k < ops; k += BENCH_BATCH) {
+                size_t end = min(ops, k + BENCH_BATCH);
+                double t = Now();
+                for (size_t q = k; q < end; q++) {
+                    sum += tree->range_sum(idx[q], idx[q] + len[q] % (n - idx[q]));
+                }
+                t = Now() - t;
+                total += t;
+                batches[nbatches++] = t / (end - k);
+            }
+            bench_sink += sum;
+            Report(tree->name, "rangesum", access_names[access], n, ops, batches, nbatches,
+                   total);
+        }
+        tree->destroy();
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t max_log = (argc > 1) ? strtoul(argv[1], NULL, 10) : 23;
+    size_t ops = (argc > 2) ? strtoul(argv[2], NULL, 10) : ((size_t) 1 << 18);
+    size_t *idx = malloc(sizeof(size_t) * ops);
+    size_t *len = malloc(sizeof(size_t) * ops);
+    double *batches = malloc(sizeof(double) * (ops / BENCH_BATCH + 1));
+    printf("# ops per cell %zu, latency is the mean of %d-op batches\n", ops, BENCH_BATCH);
+    for (size_t t = 0; t < sizeof(bench_trees) / sizeof(bench_trees[0]); t++) {
+        BenchGrid(&bench_trees[t], max_log, ops, idx, len, batches);
+    }
+    free(idx);
+    free(len);
+    free(batches);
+    return 0;
+}
+#else
 int main(){
     SegTree s;
     SegTreeInit(&s, 7);
@@ -115,3 +443,4 @@ int main(){
 
     SegTreeDestroy(&s);
 }
+#endif
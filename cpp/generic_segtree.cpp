@@ -4,102 +4,2829 @@
  *  This implementation supports generics for the data being
  *  stored in the segtreeusing templates.
  *  Implements the segtree described in the lectures notes.
+ *  Needs C++20: g++ -std=c++20 generic_segtree.cpp
+ *  Add -DSEGTREE_BENCHMARK to build the benchmark in segtree_bench.h, and
+ *  -DSEGTREE_STATS to give Segtree and FenwickSegtree operation counters.
  */ 
 
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <concepts>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <shared_mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 using namespace std;
 
-template<typename ValueType>
+// Selects how RangeSum walks the tree: Recursive is the top-down descent f
+// from the lecture notes, Iterative is the bottom-up loop g. Precomputed
+// answers in O(1) from a table that the first query after an update
+// rebuilds: a sparse table for idempotent monoids, prefix sums for
+// invertible ones. Trees without either fall back to Iterative.
+enum class QueryEngine { Recursive, Iterative, Precomputed };
+
+/**** STATISTICS ****/
+// With -DSEGTREE_STATS each Segtree, LazySegtree, WideSegtree,
+// PersistentSegtree, SparseSegtree, SegtreeForest and FenwickSegtree counts
+// the work its operations do, readable through Stats() and cleared by
+// ResetStats(), so that backends can be compared on the same workload.
+// Without it the counters, the accessors and every SEGTREE_COUNT statement
+// are compiled out, so the default build pays nothing for them.
+struct SegtreeStats {
+    uint64_t assigns = 0;        // Assign calls, including batches and RangeUpdate
+    uint64_t queries = 0;        // RangeSum calls, including those in batches
+    uint64_t glue_calls = 0;     // calls of the monoid's combine
+    uint64_t nodes_visited = 0;  // nodes a walk reads or, for f, calls on
+    uint64_t splits = 0;         // calls of f that recurse into both children
+    uint64_t max_depth = 0;      // deepest call of f, the root being depth 1
+
+    SegtreeStats& operator+=(const SegtreeStats& other) {
+        assigns += other.assigns;
+        queries += other.queries;
+        glue_calls += other.glue_calls;
+        nodes_visited += other.nodes_visited;
+        splits += other.splits;
+        max_depth = max(max_depth, other.max_depth);
+        return *this;
+    }
+};
+
+#ifdef SEGTREE_STATS
+#define SEGTREE_COUNT(...) do {__VA_ARGS__;} while (0)
+// Guards merging the counters of RangeSumBatch worker threads.
+inline mutex segtree_stats_mutex;
+#else
+#define SEGTREE_COUNT(...) do {} while (0)
+#endif
+
+// Splits [0,count) into up to threads contiguous chunks and calls
+// f(lo, hi) for each on its own thread, returning once all are done.
+// With threads <= 1 it is a plain call of f(0, count).
+template<typename F>
+void ParallelChunks(size_t count, size_t threads, F f) {
+    if (threads <= 1 || count < 2) {
+        f(0, count);
+        return;
+    }
+    vector<thread> workers;
+    size_t chunk = (count + threads - 1) / threads;
+    for (size_t lo = 0; lo < count; lo += chunk) {
+        workers.emplace_back(f, lo, min(count, lo + chunk));
+    }
+    for (thread& w : workers) w.join();
+}
+
+/**** MONOID POLICIES ****/
+// A monoid policy supplies the associative glue operation as combine and
+// its identity element as identity. The stock policies are stateless and
+// expose both as static members, so the compiler can inline every glue.
+// Policies whose glue is commutative and can be undone also give inverse,
+// which makes them usable with FenwickSegtree, and those with
+// combine(a, a) == a set idempotent. Policies for values that own
+// memory, such as small vectors, may also give combine_into(out, a, b),
+// which sets out to combine(a, b) reusing the storage out already holds;
+// Segtree then never copies a node to glue it. out is never a or b.
+template<typename T>
+struct SumMonoid {
+    static constexpr T identity() {return T(0);}
+    static constexpr T combine(T a, T b) {return a+b;}
+    static constexpr T inverse(T a) {return -a;}
+};
+
+template<typename T>
+struct MinMonoid {
+    static constexpr bool idempotent = true;
+    static constexpr T identity() {return numeric_limits<T>::max();}
+    static constexpr T combine(T a, T b) {return min(a, b);}
+};
+
+template<typename T>
+struct MaxMonoid {
+    static constexpr bool idempotent = true;
+    static constexpr T identity() {return numeric_limits<T>::lowest();}
+    static constexpr T combine(T a, T b) {return max(a, b);}
+};
+
+template<typename T>
+struct XorMonoid {
+    static constexpr T identity() {return T(0);}
+    static constexpr T combine(T a, T b) {return a^b;}
+    static constexpr T inverse(T a) {return a;}
+};
+
+// Counts elements: trees that build leaves from elements, such as
+// MultiSegtree, turn each one into a 1 through lift. Elsewhere it is just
+// a sum.
+template<typename T>
+struct CountMonoid {
+    static constexpr T identity() {return T(0);}
+    static constexpr T combine(T a, T b) {return a+b;}
+    static constexpr T inverse(T a) {return -a;}
+    static constexpr T lift(T) {return T(1);}
+};
+
+template<typename T>
+struct GcdMonoid {
+    static constexpr bool idempotent = true;
+    static constexpr T identity() {return T(0);}
+    static constexpr T combine(T a, T b) {return gcd(a, b);}
+};
+
+// Satisfied by monoid policies that can glue into an existing value.
+template<typename Monoid, typename T>
+concept InPlaceMonoid = requires (const Monoid& m, T& out, const T& a, const T& b) {
+    m.combine_into(out, a, b);
+};
+
+// Satisfied by monoid policies that declare themselves idempotent.
+template<typename Monoid>
+concept IdempotentMonoid = requires {requires Monoid::idempotent;};
+
+// Satisfied by monoid policies that declare an inverse, where
+// combine(a, inverse(a)) is the identity.
+template<typename Monoid, typename T>
+concept InvertibleMonoid = requires (const Monoid& m, T a) {
+    {m.inverse(a)} -> convertible_to<T>;
+};
+
+// Type-erased policy for glue that is only known at runtime. Every combine
+// goes through std::function, so prefer a static policy on hot paths.
+// The identity must be given alongside the glue unless T() already is one,
+// e.g. Segtree<int> s(n, multiplies<int>(), 1).
+template<typename T>
+class FunctionMonoid {
+    public:
+        FunctionMonoid(std::function<T (T, T)> glue, T identity = T())
+            : glue_func(glue), identity_element(identity) {}
+
+        T identity() const {return identity_element;}
+        T combine(T a, T b) const {return glue_func (a, b);}
+
+    private:
+        std::function<T (T, T)> glue_func;
+        T identity_element;
+};
+
+/**** LAYOUT POLICIES ****/
+// A layout policy picks N, the heap index of the leaf for element 0, and
+// how many nodes A holds. Heap index v (as used by Parent/LeftChild/
+// RightChild) is stored at A[v], so leaf k is A[N+k]. Each tree keeps a
+// layout object, set up by Reset(N) whenever N changes; NodeCount(N) is
+// then the size of A, and tag tells the layouts apart in snapshot files.
+// For trees far larger than the cache see WideSegtree, whose nodes are
+// whole cache lines.
+
+// The layout from the lecture notes: N is rounded up to a power of 2, so
+// every node covers an aligned block and both query engines work.
+struct PowerOfTwoLayout {
+    static constexpr bool aligned = true;
+    static constexpr uint64_t tag = 1;
+
+    // Returns smallest power of 2 greater than equal to n
+    static size_t SuperCeiling(size_t n) {
+        size_t p;
+        for (p=1; p < n; p = p << 1);
+        return p;
+    }
+
+    static size_t LeafBase(size_t n) {return SuperCeiling(n);}
+
+    void Reset(size_t) {}
+    size_t NodeCount(size_t N) const {return 2*N;}
+};
+
+// Uses exactly 2*n nodes. Nodes near the top may then straddle the middle of
+// the array, so f's block bookkeeping no longer holds and RangeSum always
+// uses the iterative engine g, which only relies on the heap order.
+struct CompactLayout {
+    static constexpr bool aligned = false;
+    static constexpr uint64_t tag = 2;
+
+    static size_t LeafBase(size_t n) {return max(n, (size_t)1);}
+
+    void Reset(size_t) {}
+    size_t NodeCount(size_t N) const {return 2*N;}
+};
+
+/**** STORAGE POLICIES ****/
+// Segtree keeps A in a Storage, by default a vector<ValueType>. Any type
+// with operator[], size(), capacity() and data() will do for querying and
+// updating; only construction and Rebuild need a resizable vector, which
+// may use any allocator (see AllocatedSegtree).
+
+// Non-owning storage over an array in a memory mapping made by
+// Segtree::MapFromFile. It unmaps the file when destroyed and can be moved
+// but not copied.
+template<typename T>
+class MappedStorage {
+    public:
+        MappedStorage(void* base, size_t bytes, T* items, size_t count)
+            : base(base), bytes(bytes), items(items), count(count) {}
+
+        MappedStorage(MappedStorage&& other) noexcept
+            : base(other.base), bytes(other.bytes), items(other.items), count(other.count)
+        {
+            other.base = nullptr;
+        }
+
+        MappedStorage& operator=(MappedStorage&& other) noexcept {
+            swap(base, other.base);
+            swap(bytes, other.bytes);
+            swap(items, other.items);
+            swap(count, other.count);
+            return *this;
+        }
+
+        ~MappedStorage() {
+            if (base) munmap(base, bytes);
+        }
+
+        T& operator[](size_t i) {return items[i];}
+        const T& operator[](size_t i) const {return items[i];}
+        size_t size() const {return count;}
+        size_t capacity() const {return count;}
+        T* data() {return items;}
+        const T* data() const {return items;}
+
+    private:
+        void* base;
+        size_t bytes;
+        T* items;
+        size_t count;
+};
+
+// Non-owning storage over count slots of an array owned by someone else,
+// such as one row of Segtree2D's slab. It must not outlive the array.
+template<typename T>
+class SliceStorage {
+    public:
+        SliceStorage(T* items, size_t count) : items(items), count(count) {}
+
+        T& operator[](size_t i) {return items[i];}
+        const T& operator[](size_t i) const {return items[i];}
+        size_t size() const {return count;}
+        size_t capacity() const {return count;}
+        T* data() {return items;}
+        const T* data() const {return items;}
+
+    private:
+        T* items;
+        size_t count;
+};
+
+// Start of a file written by Segtree::Save. The identity follows the header
+// and A itself starts at the next multiple of 64 bytes.
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t n;
+    uint64_t N;
+    uint64_t nodes;
+    uint64_t layout;
+    uint64_t value_size;
+};
+
+template<typename ValueType, typename Monoid = FunctionMonoid<ValueType>,
+         typename Layout = PowerOfTwoLayout, typename Storage = vector<ValueType>>
 class Segtree {
     public:
         // Constructor for segtrees.
-        Segtree(size_t size, std::function<ValueType (ValueType, ValueType)> glue) : n(size), glue_func(glue)
+        // The query engine defaults to the iterative bottom-up walk; pass
+        // QueryEngine::Recursive to use the top-down descent f instead.
+        Segtree(size_t size, Monoid monoid = Monoid(),
+                QueryEngine engine = QueryEngine::Iterative)
+            : n(size), engine(engine), monoid(monoid), identity(monoid.identity())
+        {
+            N = Layout::LeafBase(size);
+            layout.Reset(N);
+            A.resize(layout.NodeCount(N), identity);
+        }
+
+        // Constructors for segtrees whose glue is given at runtime, such as
+        // Segtree<int> s(7, plus<int>()). The identity defaults to ValueType(),
+        // which is only right for glue like plus; pass it explicitly for min,
+        // max, products and so on.
+        Segtree(size_t size, std::function<ValueType (ValueType, ValueType)> glue,
+                QueryEngine engine = QueryEngine::Iterative)
+            : Segtree(size, Monoid(glue), engine) {}
+
+        Segtree(size_t size, std::function<ValueType (ValueType, ValueType)> glue,
+                ValueType identity, QueryEngine engine = QueryEngine::Iterative)
+            : Segtree(size, Monoid(glue, identity), engine) {}
+
+        // Builds a segtree over the given leaves in O(n) glue calls instead
+        // of the O(n log n) that n calls to Assign would take. The vector is
+        // moved into A, so its buffer is reused rather than copied as long as
+        // it has capacity for the 2*N nodes. threads > 1 spreads the build
+        // over that many threads, as described at Build.
+        Segtree(vector<ValueType>&& leaves, Monoid monoid = Monoid(),
+                QueryEngine engine = QueryEngine::Iterative, size_t threads = 1)
+            : engine(engine), monoid(monoid), identity(monoid.identity())
+        {
+            Rebuild(std::move(leaves), threads);
+        }
+
+        // Same as the two constructors above, but A is built from the given
+        // allocator rather than a default constructed one, for an
+        // AllocatedSegtree whose allocator carries state, such as the arena
+        // it draws on. Rebuild resizes A in place and so keeps the allocator.
+        template<typename Allocator>
+            requires same_as<Allocator, typename Storage::allocator_type>
+        Segtree(size_t size, const Allocator& allocator, Monoid monoid = Monoid(),
+                QueryEngine engine = QueryEngine::Iterative)
+            : n(size), engine(engine), A(allocator), monoid(monoid),
+              identity(monoid.identity())
+        {
+            N = Layout::LeafBase(size);
+            layout.Reset(N);
+            A.resize(layout.NodeCount(N), identity);
+        }
+
+        template<typename Allocator>
+            requires same_as<Allocator, typename Storage::allocator_type>
+        Segtree(vector<ValueType>&& leaves, const Allocator& allocator,
+                Monoid monoid = Monoid(), QueryEngine engine = QueryEngine::Iterative,
+                size_t threads = 1)
+            : engine(engine), A(allocator), monoid(monoid), identity(monoid.identity())
         {
-            N = SuperCeiling(size);
-            A.resize(2 * N, identity);
+            Rebuild(std::move(leaves), threads);
         }
 
+        // Builds a segtree over the leaves in [first,last) in O(n).
+        template<input_iterator It>
+        Segtree(It first, It last, Monoid monoid = Monoid(),
+                QueryEngine engine = QueryEngine::Iterative)
+            : Segtree(vector<ValueType>(first, last), monoid, engine) {}
+
         // Implements Assign in the lecture notes.
         // Assigns value x to index i in the array A, and also recomputes
         // every other value in the path up to the root from index i by 
         // adding together the values of the two children below it.
-        void Assign(size_t i, ValueType x) {
-            i = i+N;
-            A[i] = x;
-            for (i = Parent(i); i>0UL; i = Parent(i)) {
-                A[i] = glue_func (A[LeftChild(i)], A[RightChild(i)]);
+        void Assign(size_t i, const ValueType& x) {
+            Node(i+N) = x;
+            Update(i+N);
+        }
+
+        // Same as above, but moves x into the leaf instead of copying it.
+        void Assign(size_t i, ValueType&& x) {
+            Node(i+N) = std::move(x);
+            Update(i+N);
+        }
+
+        // Assigns every (i, x) pair in updates, as if by Assign(i, x) in order.
+        // All the leaves are written first and then the internal nodes above
+        // them are recomputed one level at a time, so an ancestor shared by
+        // several updates is glued once rather than once per update.
+        void AssignBatch(span<const pair<size_t, ValueType>> updates) {
+            vector<size_t> dirty;
+            dirty.reserve(updates.size());
+            SEGTREE_COUNT(stats.assigns += updates.size());
+            table_valid = false;
+            for (const auto& [i, x] : updates) {
+                Node(i+N) = x;
+                dirty.push_back(Parent(i+N));
+            }
+            // Parents of a sorted level are sorted, so one sort suffices.
+            sort(dirty.begin(), dirty.end());
+            while (!dirty.empty()) {
+                dirty.erase(unique(dirty.begin(), dirty.end()), dirty.end());
+                if (dirty.front() == 0UL) dirty.erase(dirty.begin());
+                for (size_t& v : dirty) {
+                    SEGTREE_COUNT(stats.nodes_visited += 2);
+                    glue_into (Node(v), Node(LeftChild(v)), Node(RightChild(v)));
+                    v = Parent(v);
+                }
+            }
+        }
+
+        // Replaces the contents of the tree with the given leaves, resizing it
+        // to leaves.size(), and recomputes every internal node bottom-up,
+        // on up to threads threads.
+        void Rebuild(vector<ValueType>&& leaves, size_t threads = 1) {
+            n = leaves.size();
+            N = Layout::LeafBase(n);
+            layout.Reset(N);
+            if constexpr (is_same_v<Storage, vector<ValueType>>) {
+                A = std::move(leaves);
+                A.resize(layout.NodeCount(N), identity);
+                if (threads <= 1) {
+                    move_backward(A.begin(), A.begin() + n, A.begin() + N + n);
+                } else {
+                    // N >= n, so [0,n) and [N,N+n) never overlap and the
+                    // chunks can move in any order.
+                    ParallelChunks(n, threads, [this](size_t lo, size_t hi) {
+                        move(A.begin() + lo, A.begin() + hi, A.begin() + N + lo);
+                    });
+                }
+                A[0] = identity;
+            } else {
+                // A vector with another allocator cannot adopt the buffer.
+                // Reserving first makes the copy its only allocation.
+                A.clear();
+                A.reserve(layout.NodeCount(N));
+                A.assign(make_move_iterator(leaves.begin()), make_move_iterator(leaves.end()));
+                A.resize(layout.NodeCount(N), identity);
+                move_backward(A.begin(), A.begin() + n, A.begin() + N + n);
+                A[0] = identity;
             }
+            Build(threads);
+            table_valid = false;
         }
 
         // Finds sum_{i <= k <= j} A[k]
-        // More information in function f's documentation.
+        // More information in the documentation of f and g.
         ValueType RangeSum(size_t i, size_t j) {
-            return f (1UL, 0UL, (N-1), i, j);
+            ValueType out = identity;
+            RangeSumInto(i, j, out);
+            return out;
+        }
+
+        // Same as RangeSum, but const: it always walks up from the leaves,
+        // glues through the monoid directly and counts nothing in stats, so
+        // any number of threads may call it at once while none modifies the
+        // tree.
+        ValueType RangeSumShared(size_t i, size_t j) const {
+            ValueType left = identity, right = identity;
+            size_t l = i+N, r = j+N+1;
+            while (l < r) {
+                if (l & 1) left = monoid.combine(left, Node(l++));
+                if (r & 1) right = monoid.combine(Node(--r), right);
+                l = Parent(l);
+                r = Parent(r);
+            }
+            return monoid.combine(left, right);
+        }
+
+        // Returns the number of elements.
+        size_t Size() const {return n;}
+
+        // Returns element i.
+        const ValueType& Leaf(size_t i) {return Node(i+N);}
+
+        // Returns the glue of every element, which an aligned layout keeps
+        // at the root.
+        ValueType Total() {
+            if constexpr (Layout::aligned) return Node(1);
+            else return RangeSum(0, n-1);
+        }
+
+        // Same as RangeSum, but leaves the answer in out. Nodes are glued
+        // into out and scratch by reference, never copied, so with a monoid
+        // that has combine_into a query only reuses the memory those two
+        // already hold. Keep both alive across queries and a steady stream
+        // of them allocates nothing at all.
+        void RangeSumInto(size_t i, size_t j, ValueType& out) {
+            ValueType scratch = identity;
+            RangeSumInto(i, j, out, scratch);
         }
 
+        void RangeSumInto(size_t i, size_t j, ValueType& out, ValueType& scratch) {
+            SEGTREE_COUNT(stats.queries++);
+            if constexpr (IdempotentMonoid<Monoid> || InvertibleMonoid<Monoid, ValueType>) {
+                if (engine == QueryEngine::Precomputed) {
+                    out = Lookup(i, j);
+                    return;
+                }
+            }
+            out = identity;
+            if (Layout::aligned && engine == QueryEngine::Recursive) {
+                f (1UL, 0UL, (N-1), i, j, out, scratch);
+            } else {
+                g (i, j, out, scratch);
+            }
+        }
+
+        // Returns the first index j >= l at which pred(RangeSum(l, j)) is
+        // false, or n if there is none, in O(log n). pred must hold for the
+        // identity and be monotone: once false, adding more elements on the
+        // right must keep it false. For example, with a SumMonoid over
+        // non-negative volumes, MaxRight(0, [&](int v) {return v < X;}) is
+        // the first index where the running total reaches X.
+        template<typename Pred>
+        size_t MaxRight(size_t l, Pred pred) {
+            static_assert(Layout::aligned, "MaxRight needs aligned blocks");
+            SEGTREE_COUNT(stats.queries++);
+            if (l >= n) return n;
+            ValueType acc = identity;
+            l = l+N;
+            do {
+                // Climb while l is a left child: its parent starts at l too.
+                while (!(l & 1)) l = Parent(l);
+                SEGTREE_COUNT(stats.nodes_visited++);
+                if (!pred (glue (acc, Node(l)))) {
+                    // The answer lies inside l; descend towards it.
+                    while (l < N) {
+                        l = LeftChild(l);
+                        SEGTREE_COUNT(stats.nodes_visited++);
+                        if (pred (glue (acc, Node(l)))) acc = glue (acc, Node(l++));
+                    }
+                    return l - N;
+                }
+                acc = glue (acc, Node(l++));
+            } while ((l & (~l + 1)) != l);
+            return n;
+        }
+
+        // Mirror image of MaxRight: returns the smallest i <= j+1 such that
+        // pred(RangeSum(k, j)) holds for every k with i <= k <= j, where
+        // i = j+1 means that pred already fails on A[j] alone.
+        template<typename Pred>
+        size_t MinLeft(size_t j, Pred pred) {
+            static_assert(Layout::aligned, "MinLeft needs aligned blocks");
+            SEGTREE_COUNT(stats.queries++);
+            ValueType acc = identity;
+            size_t r = j+1+N;
+            do {
+                r--;
+                // Climb while r is a right child: its parent ends at r too.
+                while (r > 1 && (r & 1)) r = Parent(r);
+                SEGTREE_COUNT(stats.nodes_visited++);
+                if (!pred (glue (Node(r), acc))) {
+                    while (r < N) {
+                        r = RightChild(r);
+                        SEGTREE_COUNT(stats.nodes_visited++);
+                        if (pred (glue (Node(r), acc))) acc = glue (Node(r--), acc);
+                    }
+                    return r + 1 - N;
+                }
+                acc = glue (Node(r), acc);
+            } while ((r & (~r + 1)) != r);
+            return 0;
+        }
+
+        // Writes the tree to path as a SnapshotHeader, the identity and then
+        // A byte for byte, so that MapFromFile can use it without parsing.
+        void Save(const string& path) const {
+            static_assert(is_trivially_copyable_v<ValueType>, "Save writes A as raw bytes");
+            SnapshotHeader header = {{'S','E','G','T','R','E','E','1'},
+                                     n, N, A.size(), Layout::tag, sizeof(ValueType)};
+            vector<char> prefix(SnapshotPrefix(), 0);
+            memcpy(prefix.data(), &header, sizeof(header));
+            memcpy(prefix.data() + sizeof(header), &identity, sizeof(ValueType));
+            FILE* file = fopen(path.c_str(), "wb");
+            if (!file) throw runtime_error("Save: cannot open " + path);
+            bool ok = fwrite(prefix.data(), 1, prefix.size(), file) == prefix.size()
+                   && fwrite(A.data(), sizeof(ValueType), A.size(), file) == A.size();
+            ok = (fclose(file) == 0) && ok;
+            if (!ok) throw runtime_error("Save: cannot write " + path);
+        }
+
+        // Maps a file written by Save and returns a tree that serves queries
+        // straight from the mapping, so nothing is read until it is touched.
+        // The mapping is private: Assign works on the result but never
+        // changes the file. Throws runtime_error if the file was not saved
+        // from a tree with the same value type, layout and identity, or if
+        // its header does not describe a complete tree of that layout.
+        static Segtree<ValueType, Monoid, Layout, MappedStorage<ValueType>>
+        MapFromFile(const string& path, Monoid monoid = Monoid(),
+                    QueryEngine engine = QueryEngine::Iterative) {
+            static_assert(is_trivially_copyable_v<ValueType>, "MapFromFile reads A as raw bytes");
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) throw runtime_error("MapFromFile: cannot open " + path);
+            struct stat st;
+            size_t bytes = (fstat(fd, &st) == 0) ? (size_t)st.st_size : 0;
+            void* base = (bytes > 0) ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+                                     : MAP_FAILED;
+            close(fd);
+            if (base == MAP_FAILED) throw runtime_error("MapFromFile: cannot map " + path);
+
+            SnapshotHeader header;
+            ValueType identity = monoid.identity();
+            size_t prefix = SnapshotPrefix();
+            bool ok = bytes >= prefix;
+            if (ok) {
+                memcpy(&header, base, sizeof(header));
+                ok = memcmp(header.magic, "SEGTREE1", 8) == 0
+                  && header.layout == Layout::tag && header.value_size == sizeof(ValueType)
+                  && memcmp((char*)base + sizeof(header), &identity, sizeof(ValueType)) == 0
+                  && header.nodes <= (bytes - prefix) / sizeof(ValueType);
+            }
+            // The shape must be the one Layout gives n elements, or queries
+            // would index past the nodes that are actually in the file.
+            if (ok) {
+                Layout layout;
+                ok = header.N == Layout::LeafBase(header.n);
+                if (ok) layout.Reset(header.N);
+                ok = ok && header.nodes == layout.NodeCount(header.N);
+            }
+            if (!ok) {
+                munmap(base, bytes);
+                throw runtime_error("MapFromFile: " + path + " does not hold a matching segtree");
+            }
+            MappedStorage<ValueType> storage(base, bytes,
+                                             (ValueType*)((char*)base + prefix), header.nodes);
+            return Segtree<ValueType, Monoid, Layout, MappedStorage<ValueType>>(
+                header.n, header.N, std::move(storage), monoid, engine);
+        }
+
+        // Wraps nodes that already hold a complete tree over size elements,
+        // laid out by Layout, without copying or rebuilding them.
+        static Segtree Adopt(size_t size, Storage&& nodes, Monoid monoid = Monoid(),
+                             QueryEngine engine = QueryEngine::Iterative) {
+            return Segtree(size, Layout::LeafBase(size), std::move(nodes), monoid, engine);
+        }
+
+        // Returns the number of bytes held by the tree, counting the node
+        // array A but not anything ValueType itself allocates.
+        size_t MemoryUsage() const {
+            return sizeof(*this) + (A.capacity() + table.capacity()) * sizeof(ValueType);
+        }
+
+        // Answers a batch of independent queries: out[k] = RangeSum(i, j) for
+        // each queries[k] = (i, j). With threads > 1 the batch is split into
+        // contiguous chunks that are answered in parallel; the tree must not
+        // be modified until the call returns.
+        void RangeSumBatch(span<const pair<size_t, size_t>> queries, span<ValueType> out,
+                           size_t threads = 1) {
+            if (queries.size() < 2*threads) threads = 1;
+            ParallelChunks(queries.size(), threads, [this, queries, out](size_t lo, size_t hi) {
+                h (queries.subspan(lo, hi-lo), out.subspan(lo, hi-lo));
+            });
+        }
+
+#ifdef SEGTREE_STATS
+        // Returns the counters accumulated since construction or ResetStats.
+        const SegtreeStats& Stats() const {return stats;}
+        void ResetStats() {stats = SegtreeStats();}
+#endif
+
         // Prints the contents of the array A
         void printA() {
-            for (size_t i=0; i < 2*N; i++) {
+            for (size_t i=0; i < A.size(); i++) {
                 cout << "A[" << i << "] = " << A[i] << endl;
             }
         }
 
-    private:
+    protected:
+        template<typename, typename, typename, typename> friend class Segtree;
+
         size_t n;
         size_t N;
-        vector<ValueType> A;
-        ValueType identity = 0;
-        std::function<ValueType (ValueType, ValueType)> glue_func;
+        QueryEngine engine;
+        Storage A;
+        Layout layout;
+        Monoid monoid;
+        ValueType identity;
+        // Answers for QueryEngine::Precomputed, rebuilt when stale
+        vector<ValueType> table;
+        bool table_valid = false;
+#ifdef SEGTREE_STATS
+        SegtreeStats stats;
+#endif
 
+        // Adopts nodes that already hold a complete tree, for MapFromFile
+        Segtree(size_t n, size_t N, Storage&& nodes, Monoid monoid, QueryEngine engine)
+            : n(n), N(N), engine(engine), A(std::move(nodes)), monoid(monoid),
+              identity(monoid.identity())
+        {
+            layout.Reset(N);
+        }
 
-        // Returns smallest power of 2 greater than equal to n
-        size_t SuperCeiling(size_t n) {
-            size_t p;
-            for (p=1; p < n; p = p << 1);
-            return p;
+        // Size of the header, identity and padding in front of A in a snapshot
+        static size_t SnapshotPrefix() {
+            return (sizeof(SnapshotHeader) + sizeof(ValueType) + 63) / 64 * 64;
         }
 
         // Tree index functions
-        size_t Parent(size_t i) {return i/2;}
-        size_t LeftChild(size_t i) {return 2*i;}
-        size_t RightChild(size_t i) {return 2*i+1;}
+        size_t Parent(size_t i) const {return i/2;}
+        size_t LeftChild(size_t i) const {return 2*i;}
+        size_t RightChild(size_t i) const {return 2*i+1;}
+
+        // Returns the node with heap index v
+        ValueType& Node(size_t v) {return A[v];}
+        const ValueType& Node(size_t v) const {return A[v];}
+
+        // Recomputes every ancestor of the heap index v from its children.
+        void Update(size_t v) {
+            SEGTREE_COUNT(stats.assigns++);
+            table_valid = false;
+            for (v = Parent(v); v>0UL; v = Parent(v)) {
+                SEGTREE_COUNT(stats.nodes_visited += 2);
+                glue_into (Node(v), Node(LeftChild(v)), Node(RightChild(v)));
+            }
+        }
+
+        // Fills in every internal node from its children, deepest level
+        // first, in a single linear pass over A.
+        //
+        // With threads > 1 the nodes at some depth L, about 8 per thread, are
+        // handed out in contiguous runs, and each thread builds the subtrees
+        // below its run level by level. Every level of a subtree is one
+        // contiguous index range whose children belong to the same thread,
+        // so the threads need no barrier between levels. The 2^L-1 nodes
+        // above depth L are then finished serially.
+        void Build(size_t threads = 1) {
+            size_t roots = bit_ceil(8 * threads);
+            if (threads <= 1 || N < 64 * roots) {
+                for (size_t i = N-1; i > 0UL; i--) {
+                    glue_into (Node(i), Node(LeftChild(i)), Node(RightChild(i)));
+                }
+                return;
+            }
+            size_t L = countr_zero(roots);
+            size_t deepest = bit_width(N-1) - 1;
+            ParallelChunks(roots, threads, [&](size_t lo, size_t hi) {
+                for (size_t d = deepest; d >= L; d--) {
+                    size_t first = (roots + lo) << (d-L);
+                    size_t last = min((roots + hi) << (d-L), N);
+                    for (size_t i = first; i < last; i++) {
+                        combine_into (Node(i), Node(LeftChild(i)), Node(RightChild(i)));
+                    }
+                }
+            });
+            SEGTREE_COUNT(stats.glue_calls += N - roots);
+            for (size_t i = roots-1; i > 0UL; i--) {
+                glue_into (Node(i), Node(LeftChild(i)), Node(RightChild(i)));
+            }
+        }
+
+        // Glues two elements together with the monoid's operator
+        ValueType glue(ValueType a, ValueType b) {
+            SEGTREE_COUNT(stats.glue_calls++);
+            return monoid.combine(a, b);
+        }
+
+        // Sets out to glue(a, b) in place when the monoid has combine_into.
+        // out must be neither a nor b.
+        void glue_into(ValueType& out, const ValueType& a, const ValueType& b) {
+            SEGTREE_COUNT(stats.glue_calls++);
+            combine_into(out, a, b);
+        }
+
+        // Same as glue_into but not counted, so that threads may share it.
+        void combine_into(ValueType& out, const ValueType& a, const ValueType& b) {
+            if constexpr (InPlaceMonoid<Monoid, ValueType>) {
+                monoid.combine_into(out, a, b);
+            } else {
+                out = monoid.combine(a, b);
+            }
+        }
+
+        // Glues b onto the right of acc, using scratch for the result so
+        // that acc is not read and written by the same glue.
+        void append(ValueType& acc, const ValueType& b, ValueType& scratch) {
+            glue_into (scratch, acc, b);
+            swap(acc, scratch);
+        }
+
+        // What f runs before splitting the query at a node: nothing here,
+        // while LazySegtree pushes the node's pending tag down.
+        struct NoSplitHook {void operator()(size_t, size_t) const {}};
 
-        ValueType f (size_t v, size_t l, size_t r, size_t i, size_t j) {
+        template<typename SplitHook = NoSplitHook>
+        void f (size_t v, size_t l, size_t r, size_t i, size_t j,
+                ValueType& acc, ValueType& scratch, SplitHook before_split = SplitHook()) {
         /*  We’re currently at A[v]. 1 <= v < 2*N.
             The range [l,r] is that of the current block, wrt user variables [0,n-1].
             The range [i,j] is the range of the query, wrt user variables [0,n-1].
             The size of the range [l,r] = r-l+1 is a power of 2.
             The range [l,r] contains the range [i,j].
-            This function returns the answer to the query.
+            This function glues the answer to the query onto the right of acc.
+            The left half is always visited before the right one, so the
+            blocks arrive in order and acc can be built up in place instead
+            of returning a copy of each block.
+            before_split(v, r-l+1) runs whenever the walk goes below v.
         */
-            ValueType t1, t2;
             size_t m;
+            SEGTREE_COUNT(stats.nodes_visited++;
+                          stats.max_depth = max<uint64_t>(stats.max_depth, bit_width(v)));
             if (l==i && r==j) {
-                return A[v];
+                append (acc, Node(v), scratch);
             } else {
+                before_split(v, r-l+1);
                 m = (l+r)/2; // split [l,r] into [l,m] [m+1,r]
-                t1 = (i <= m) ? f (LeftChild(v), l, m, i, (min(m,j))): identity;
-                t2 = (j > m) ? f (RightChild(v), (m+1), r, (max(i,(m+1))), j): identity;
-                return glue_func (t1, t2);
+                SEGTREE_COUNT(stats.splits += (i <= m && j > m));
+                if (i <= m) f (LeftChild(v), l, m, i, (min(m,j)), acc, scratch, before_split);
+                if (j > m) f (RightChild(v), (m+1), r, (max(i,(m+1))), j, acc, scratch, before_split);
+            }
+        }
+
+        void g (size_t i, size_t j, ValueType& left, ValueType& scratch) {
+        /*  Iterative version of f that walks up from the leaves instead of
+            descending from the root.
+            The half-open range [l,r) holds the nodes still to be added in.
+            Whenever l is a right child, A[l] lies entirely inside the query
+            and is glued onto the left accumulator left. Likewise r-1 being a
+            left child belongs on the right side. Keeping the two sides apart
+            preserves the order of the operands, so glue need not commute.
+            Plain values get a right accumulator; for values that own memory
+            the right-side nodes are stacked instead and glued on in reverse
+            at the end, so that no second accumulator has to allocate.
+        */
+            size_t l = i+N, r = j+N+1;
+            if constexpr (is_trivially_copyable_v<ValueType>) {
+                ValueType right = identity;
+                while (l < r) {
+                    SEGTREE_COUNT(stats.nodes_visited += (l & 1) + (r & 1));
+                    if (l & 1) append (left, Node(l++), scratch);
+                    if (r & 1) right = glue (Node(--r), right);
+                    l = Parent(l);
+                    r = Parent(r);
+                }
+                append (left, right, scratch);
+                return;
+            }
+            size_t stack[64];
+            size_t top = 0;
+            while (l < r) {
+                SEGTREE_COUNT(stats.nodes_visited += (l & 1) + (r & 1));
+                if (l & 1) append (left, Node(l++), scratch);
+                if (r & 1) stack[top++] = --r;
+                l = Parent(l);
+                r = Parent(r);
+            }
+            while (top > 0) append (left, Node(stack[--top]), scratch);
+        }
+
+        ValueType Lookup (size_t i, size_t j) {
+        /*  Precomputed answer to RangeSum(i, j), rebuilding the table first
+            if an update made it stale. Concurrent queries must not race a
+            rebuild, so this engine suits trees that are read far more often
+            than written.
+            For idempotent glue, table[k*n + p] holds the glue of the 2^k
+            elements from p, and any range is covered by the two blocks of
+            the largest such size that fit it, overlapping in the middle.
+            For invertible glue, table[p] is the glue of the first p
+            elements and a range is one prefix with a shorter one undone.
+        */
+            j = min(j, n-1);
+            if (n == 0 || i > j) return identity;
+            if (!table_valid) {
+                BuildTable();
+                table_valid = true;
+            }
+            if constexpr (IdempotentMonoid<Monoid>) {
+                size_t k = bit_width(j-i+1) - 1;
+                return glue (table[k*n + i], table[k*n + j+1 - (size_t(1) << k)]);
+            } else {
+                return glue (monoid.inverse(table[i]), table[j+1]);
+            }
+        }
+
+        void BuildTable() {
+            if constexpr (IdempotentMonoid<Monoid>) {
+                size_t levels = bit_width(n);
+                table.assign(levels * n, identity);
+                for (size_t p = 0; p < n; p++) table[p] = Node(p+N);
+                for (size_t k = 1; k < levels; k++) {
+                    size_t half = size_t(1) << (k-1);
+                    for (size_t p = 0; p + 2*half <= n; p++) {
+                        table[k*n + p] = glue (table[(k-1)*n + p], table[(k-1)*n + p + half]);
+                    }
+                }
+            } else {
+                table.assign(n+1, identity);
+                for (size_t p = 0; p < n; p++) table[p+1] = glue (table[p], Node(p+N));
+            }
+        }
+
+        // Number of queries whose walks RangeSumBatch runs side by side.
+        static constexpr size_t Interleave = 8;
+
+        void h (span<const pair<size_t, size_t>> queries, span<ValueType> out) {
+        /*  Runs g for up to Interleave queries at once, advancing each of
+            them by one level per round. The loads of different queries do
+            not depend on each other, so their cache misses overlap instead
+            of being paid one after another on trees larger than the cache.
+        */
+            size_t l[Interleave], r[Interleave];
+            vector<ValueType> left(Interleave, identity), right(Interleave, identity);
+            // h may run on several threads at once, so it counts into a local
+            // copy that is merged once at the end rather than through glue.
+#ifdef SEGTREE_STATS
+            SegtreeStats local;
+            local.queries = queries.size();
+#endif
+            auto combine = [&](const ValueType& a, const ValueType& b) {
+                SEGTREE_COUNT(local.glue_calls++);
+                return monoid.combine(a, b);
+            };
+            for (size_t base = 0; base < queries.size(); base += Interleave) {
+                size_t k = min(Interleave, queries.size() - base);
+                for (size_t t = 0; t < k; t++) {
+                    l[t] = queries[base+t].first+N;
+                    r[t] = queries[base+t].second+N+1;
+                    left[t] = right[t] = identity;
+                }
+                for (bool active = true; active; ) {
+                    active = false;
+                    for (size_t t = 0; t < k; t++) {
+                        if (l[t] >= r[t]) continue;
+                        SEGTREE_COUNT(local.nodes_visited += (l[t] & 1) + (r[t] & 1));
+                        if (l[t] & 1) left[t] = combine (left[t], Node(l[t]++));
+                        if (r[t] & 1) right[t] = combine (Node(--r[t]), right[t]);
+                        l[t] = Parent(l[t]);
+                        r[t] = Parent(r[t]);
+                        active = true;
+                    }
+                }
+                for (size_t t = 0; t < k; t++) {
+                    out[base+t] = combine (left[t], right[t]);
+                }
             }
+#ifdef SEGTREE_STATS
+            lock_guard<mutex> lock(segtree_stats_mutex);
+            stats += local;
+#endif
         }
 };
 
-int main() {
-    Segtree<int> s(7, plus<int>());
-    s.Assign(3,7);
-    s.Assign(4,1);
+// Segtree whose node array is a vector drawing on Allocator, e.g. a pool
+// or arena allocator shared by many trees. Allocators that cannot be
+// default constructed are passed to the constructor after the size or
+// leaves.
+template<typename ValueType, typename Monoid, typename Allocator,
+         typename Layout = PowerOfTwoLayout>
+using AllocatedSegtree = Segtree<ValueType, Monoid, Layout, vector<ValueType, Allocator>>;
 
-    s.printA();
-    
-    printf(" RangeSum(2,7) = %d\n", s.RangeSum(2,7));
-    printf(" RangeSum(0,3) = %d\n", s.RangeSum(0,3));
-    printf(" RangeSum(4,5) = %d\n", s.RangeSum(4,5));
-    printf(" RangeSum(5,5) = %d\n", s.RangeSum(5,5));
+/**** LAZY PROPAGATION ****/
+// An action policy describes updates applied to a whole range at once.
+// Tag is the type of a pending update and identity() the tag that changes
+// nothing. compose(newer, older) is the single tag that has the effect of
+// older followed by newer. apply(tag, value, length) is the new aggregate of
+// a block of length elements, whose old aggregate was value, after tag has
+// been applied to each of its elements.
+
+// Adds a delta to every element of a sum tree.
+template<typename T>
+struct AddToSum {
+    using Tag = T;
+    static constexpr Tag identity() {return T(0);}
+    static constexpr Tag compose(Tag newer, Tag older) {return newer+older;}
+    static constexpr T apply(Tag tag, T value, size_t length) {
+        return value + tag*(T)length;
+    }
+};
+
+// Adds a delta to every element of a min or max tree.
+template<typename T>
+struct AddToMinMax {
+    using Tag = T;
+    static constexpr Tag identity() {return T(0);}
+    static constexpr Tag compose(Tag newer, Tag older) {return newer+older;}
+    static constexpr T apply(Tag tag, T value, size_t) {return value+tag;}
+};
+
+// Sets every element of a sum tree to the same value.
+template<typename T>
+struct AssignToSum {
+    using Tag = optional<T>;
+    static constexpr Tag identity() {return nullopt;}
+    static constexpr Tag compose(Tag newer, Tag older) {return newer ? newer : older;}
+    static constexpr T apply(Tag tag, T value, size_t length) {
+        return tag ? *tag*(T)length : value;
+    }
+};
+
+// Sets every element of a min or max tree to the same value.
+template<typename T>
+struct AssignToMinMax {
+    using Tag = optional<T>;
+    static constexpr Tag identity() {return nullopt;}
+    static constexpr Tag compose(Tag newer, Tag older) {return newer ? newer : older;}
+    static constexpr T apply(Tag tag, T value, size_t) {return tag ? *tag : value;}
+};
+
+// Segtree that also supports RangeUpdate, which applies a tag to every
+// element of a range in O(log n). Every internal node v carries lazy[v], a
+// tag already reflected in A[v] but not yet pushed down to its children.
+// Queries use Segtree's recursive descent f, pushing tags down on the way.
+template<typename ValueType, typename Monoid, typename Action>
+class LazySegtree : protected Segtree<ValueType, Monoid> {
+    using Base = Segtree<ValueType, Monoid>;
+    using Tag = typename Action::Tag;
+    using Base::N;
+    using Base::LeftChild;
+    using Base::RightChild;
+    using Base::Node;
+
+    public:
+        // Constructor for lazy segtrees.
+        LazySegtree(size_t size, Monoid monoid = Monoid())
+            : Base(size, monoid, QueryEngine::Recursive),
+              lazy(this->N, Action::identity()) {}
+
+        // Builds a lazy segtree over the given leaves in O(n).
+        LazySegtree(vector<ValueType>&& leaves, Monoid monoid = Monoid())
+            : Base(std::move(leaves), monoid, QueryEngine::Recursive),
+              lazy(this->N, Action::identity()) {}
+
+        // Assigns value x to index i. Pending tags on the path from the root
+        // are pushed down first so that the recomputed ancestors see them.
+        void Assign(size_t i, ValueType x) {
+            i = i+N;
+            for (size_t h = countr_zero(N); h > 0UL; h--) {
+                Push(i >> h, 1UL << (h-1));
+            }
+            Node(i) = std::move(x);
+            this->Update(i);
+        }
+
+        // Applies tag to every A[k] with i <= k <= j.
+        void RangeUpdate(size_t i, size_t j, Tag tag) {
+            SEGTREE_COUNT(this->stats.assigns++);
+            u (1UL, 0UL, (N-1), i, j, tag);
+        }
+
+        // Finds sum_{i <= k <= j} A[k]
+        ValueType RangeSum(size_t i, size_t j) {
+            SEGTREE_COUNT(this->stats.queries++);
+            ValueType out = this->identity, scratch = this->identity;
+            this->f (1UL, 0UL, (N-1), i, j, out, scratch,
+                     [this](size_t v, size_t length) {Push(v, length/2);});
+            return out;
+        }
+
+        // Replaces the contents of the tree and drops every pending tag.
+        void Rebuild(vector<ValueType>&& leaves) {
+            Base::Rebuild(std::move(leaves));
+            lazy.assign(N, Action::identity());
+        }
+
+        size_t MemoryUsage() const {
+            return Base::MemoryUsage() + lazy.capacity() * sizeof(Tag);
+        }
+
+#ifdef SEGTREE_STATS
+        using Base::Stats;
+        using Base::ResetStats;
+#endif
+        using Base::printA;
+
+    private:
+        vector<Tag> lazy;
+
+        // Applies tag to node v, which covers length elements.
+        void Apply(size_t v, Tag tag, size_t length) {
+            Node(v) = Action::apply(tag, Node(v), length);
+            if (v < N) lazy[v] = Action::compose(tag, lazy[v]);
+        }
+
+        // Moves the pending tag of internal node v onto its children, each
+        // of which covers half elements.
+        void Push(size_t v, size_t half) {
+            Apply(LeftChild(v), lazy[v], half);
+            Apply(RightChild(v), lazy[v], half);
+            lazy[v] = Action::identity();
+        }
+
+        // Same descent as Segtree::f, applying tag to the maximal blocks inside [i,j]
+        // and recomputing every node above them on the way back up.
+        void u (size_t v, size_t l, size_t r, size_t i, size_t j, Tag tag) {
+            size_t m;
+            SEGTREE_COUNT(this->stats.nodes_visited++);
+            if (l==i && r==j) {
+                Apply(v, tag, r-l+1);
+            } else {
+                Push(v, (r-l+1)/2);
+                m = (l+r)/2;
+                SEGTREE_COUNT(this->stats.splits += (i <= m && j > m));
+                if (i <= m) u (LeftChild(v), l, m, i, (min(m,j)), tag);
+                if (j > m) u (RightChild(v), (m+1), r, (max(i,(m+1))), j, tag);
+                this->glue_into (Node(v), Node(LeftChild(v)), Node(RightChild(v)));
+            }
+        }
+};
+
+/**** WIDE SIMD SEGTREE ****/
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SEGTREE_X86_DISPATCH
+#endif
+
+// Glues lanes [a,b] of a line of B values together. The loop has a fixed
+// trip count and no branches, so for integer types the compiler turns it
+// into a masked load and a horizontal reduction on whatever vector unit the
+// calling function is compiled for.
+template<typename T, typename Monoid, size_t B>
+[[gnu::always_inline]] inline T ReduceLine(const T* line, size_t a, size_t b) {
+    using Lane = conditional_t<sizeof(T) == 8, int64_t, int32_t>;
+    T acc = Monoid::identity();
+    Lane lo = (Lane)a, hi = (Lane)b;
+    for (Lane k = 0; k < (Lane)B; k++) {
+        T x = (k >= lo && k <= hi) ? line[k] : Monoid::identity();
+        acc = Monoid::combine(acc, x);
+    }
+    return acc;
+}
+
+#ifdef SEGTREE_X86_DISPATCH
+template<typename T, typename Monoid, size_t B>
+[[gnu::target("avx2")]] T ReduceLineAVX2(const T* line, size_t a, size_t b) {
+    return ReduceLine<T, Monoid, B>(line, a, b);
+}
+
+template<typename T, typename Monoid, size_t B>
+[[gnu::target("avx512f,avx512bw")]] T ReduceLineAVX512(const T* line, size_t a, size_t b) {
+    return ReduceLine<T, Monoid, B>(line, a, b);
+}
+#endif
+
+// Segment tree over an arithmetic type for a commutative static monoid such
+// as SumMonoid, MinMonoid or MaxMonoid, whose nodes have B = 64/sizeof(T)
+// children so that each node is one cache line and there are only log_B(n)
+// levels. Level 0 holds the leaves, and value x of level k+1 is the glue of
+// line x of level k. Both Assign and RangeSum glue one run of lanes per line
+// they visit, using the AVX-512 or AVX2 build of ReduceLine picked for the
+// CPU at construction. Without either (or off x86) the tree falls back to an
+// ordinary binary Segtree.
+template<typename T, typename Monoid>
+class WideSegtree {
+    static_assert(is_arithmetic_v<T>, "WideSegtree needs an arithmetic value type");
+
+    public:
+        static constexpr size_t B = 64 / sizeof(T);
+
+        // Constructor for wide segtrees.
+        WideSegtree(size_t size) : WideSegtree(vector<T>(size, Monoid::identity())) {}
+
+        // Builds a wide segtree over the given leaves in O(n).
+        WideSegtree(vector<T>&& leaves) : n(leaves.size()), binary(0) {
+            reduce = PickReduce();
+            if (!reduce) {
+                binary.Rebuild(std::move(leaves));
+                return;
+            }
+            size_t count = max(n, (size_t)1), total = 0;
+            for (;;) {
+                size_t lines = (count + B - 1) / B;
+                offset.push_back(total);
+                total += lines;
+                if (lines == 1) break;
+                count = lines;
+            }
+            Line empty;
+            fill(empty.lane, empty.lane + B, Monoid::identity());
+            nodes.assign(total, empty);
+            for (size_t k = 0; k < n; k++) Value(0, k) = leaves[k];
+            for (size_t k = 0; k+1 < offset.size(); k++) {
+                for (size_t x = offset[k]; x < offset[k+1]; x++) {
+                    Value(k+1, x - offset[k]) = reduce(nodes[x].lane, 0, B-1);
+                }
+            }
+        }
+
+        // Returns true if the tree is using vector instructions rather than
+        // the binary fallback.
+        bool Vectorized() const {return reduce != nullptr;}
+
+        // Assigns value x to index i and recomputes the one value per level
+        // above it from its whole line.
+        void Assign(size_t i, T x) {
+            if (!reduce) return binary.Assign(i, x);
+            SEGTREE_COUNT(stats.assigns++);
+            for (size_t k = 0; ; k++) {
+                Value(k, i) = x;
+                if (k+1 == offset.size()) break;
+                // A line reduction glues B values, i.e. B-1 combines.
+                SEGTREE_COUNT(stats.nodes_visited++; stats.glue_calls += B-1);
+                x = reduce(nodes[offset[k] + i/B].lane, 0, B-1);
+                i = i/B;
+            }
+        }
+
+        // Finds sum_{i <= k <= j} A[k]
+        // At each level the partial lines at either end of [i,j] are glued
+        // in and [i,j] shrinks to the whole lines between them, which are
+        // consecutive values one level up.
+        T RangeSum(size_t i, size_t j) {
+            if (!reduce) return binary.RangeSum(i, j);
+            SEGTREE_COUNT(stats.queries++);
+            T result = Monoid::identity();
+            for (size_t k = 0; ; k++) {
+                const Line* level = &nodes[offset[k]];
+                size_t bi = i/B, bj = j/B;
+                if (bi == bj) {
+                    SEGTREE_COUNT(stats.nodes_visited++; stats.glue_calls += j%B - i%B + 1);
+                    return Monoid::combine(result, reduce(level[bi].lane, i%B, j%B));
+                }
+                SEGTREE_COUNT(stats.nodes_visited += 2; stats.glue_calls += B - i%B + j%B + 1);
+                result = Monoid::combine(result, reduce(level[bi].lane, i%B, B-1));
+                result = Monoid::combine(result, reduce(level[bj].lane, 0, j%B));
+                if (bi+1 == bj) return result;
+                i = bi+1;
+                j = bj-1;
+            }
+        }
+
+        // Returns the number of bytes held by the tree.
+        size_t MemoryUsage() const {
+            return sizeof(*this) + nodes.capacity() * sizeof(Line)
+                 + offset.capacity() * sizeof(size_t)
+                 + binary.MemoryUsage() - sizeof(binary);
+        }
+
+#ifdef SEGTREE_STATS
+        // Returns the counters accumulated since construction or ResetStats,
+        // those of the binary fallback if the tree is not vectorized.
+        const SegtreeStats& Stats() const {return reduce ? stats : binary.Stats();}
+        void ResetStats() {
+            stats = SegtreeStats();
+            binary.ResetStats();
+        }
+#endif
+
+    private:
+        struct alignas(64) Line {
+            T lane[B];
+        };
+
+        size_t n;
+        vector<Line> nodes;
+        vector<size_t> offset;   // first line of each level
+        T (*reduce)(const T*, size_t, size_t);
+        Segtree<T, Monoid> binary;
+#ifdef SEGTREE_STATS
+        SegtreeStats stats;
+#endif
+
+        T& Value(size_t k, size_t x) {return nodes[offset[k] + x/B].lane[x%B];}
+
+        static auto PickReduce() -> T (*)(const T*, size_t, size_t) {
+#ifdef SEGTREE_X86_DISPATCH
+            if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+                return ReduceLineAVX512<T, Monoid, B>;
+            }
+            if (__builtin_cpu_supports("avx2")) return ReduceLineAVX2<T, Monoid, B>;
+#endif
+            return nullptr;
+        }
+};
+
+/**** CONCURRENT SEGTREE ****/
+// Segtree shared between any number of reader threads and writer threads,
+// in which readers never take a lock. Every node of A is a std::atomic, so
+// ValueType must be trivially copyable; for primitive types the atomics are
+// lock-free and so are the readers. Writers are serialized by a mutex, and
+// each Assign stores the leaf and then its ancestors with release ordering.
+//
+// Consistency guarantees:
+//  - RangeSum never blocks and never sees a torn value. Each element in
+//    [i,j] contributes a value it actually held while the query ran, i.e.
+//    either the old or the new value of an Assign that overlaps the query.
+//    Different elements may be seen at different moments, so with several
+//    Assigns in flight the answer need not match any single state of A.
+//  - RangeSumSnapshot gives the answer for one state of A, taken between two
+//    Assigns. It is a seqlock read: it retries if an Assign ran during the
+//    query, so it is lock-free rather than wait-free under heavy writing.
+//  - An Assign that returns before a query starts (in the happens-before
+//    sense, e.g. via a flag the reader acquires) is seen by that query.
+template<typename ValueType, typename Monoid>
+class ConcurrentSegtree {
+    static_assert(is_trivially_copyable_v<ValueType>,
+                  "ConcurrentSegtree keeps its nodes in std::atomic");
+
+    public:
+        // Constructor for concurrent segtrees.
+        ConcurrentSegtree(size_t size, Monoid monoid = Monoid())
+            : n(size), N(PowerOfTwoLayout::SuperCeiling(size)), A(2 * N),
+              monoid(monoid), identity(monoid.identity())
+        {
+            for (atomic<ValueType>& a : A) a.store(identity, memory_order_relaxed);
+        }
+
+        // Assigns value x to index i and republishes the path to the root.
+        void Assign(size_t i, ValueType x) {
+            lock_guard<mutex> lock(writer);
+            size_t s = version.load(memory_order_relaxed);
+            version.store(s+1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            i = i+N;
+            A[i].store(x, memory_order_release);
+            for (i = Parent(i); i>0UL; i = Parent(i)) {
+                ValueType v = glue (A[LeftChild(i)].load(memory_order_relaxed),
+                                    A[RightChild(i)].load(memory_order_relaxed));
+                A[i].store(v, memory_order_release);
+            }
+            version.store(s+2, memory_order_release);
+        }
+
+        // Finds sum_{i <= k <= j} A[k], with the iterative walk of
+        // Segtree::g. See above for what it may observe.
+        ValueType RangeSum(size_t i, size_t j) const {
+            return g (i, j, memory_order_acquire);
+        }
+
+        // Like RangeSum, but the answer reflects a single state of the tree.
+        ValueType RangeSumSnapshot(size_t i, size_t j) const {
+            for (;;) {
+                size_t s = version.load(memory_order_acquire);
+                if (s & 1) continue;
+                ValueType result = g (i, j, memory_order_relaxed);
+                atomic_thread_fence(memory_order_acquire);
+                if (version.load(memory_order_relaxed) == s) return result;
+            }
+        }
+
+    private:
+        size_t n;
+        size_t N;
+        vector<atomic<ValueType>> A;
+        Monoid monoid;
+        ValueType identity;
+        mutex writer;
+        // Odd while an Assign is rewriting a path
+        atomic<size_t> version{0};
+
+        // Tree index functions
+        size_t Parent(size_t i) const {return i/2;}
+        size_t LeftChild(size_t i) const {return 2*i;}
+        size_t RightChild(size_t i) const {return 2*i+1;}
+
+        ValueType glue(ValueType a, ValueType b) const {
+            return monoid.combine(a, b);
+        }
+
+        ValueType g (size_t i, size_t j, memory_order order) const {
+            ValueType left = identity, right = identity;
+            size_t l = i+N, r = j+N+1;
+            while (l < r) {
+                if (l & 1) left = glue (left, A[l++].load(order));
+                if (r & 1) right = glue (A[--r].load(order), right);
+                l = Parent(l);
+                r = Parent(r);
+            }
+            return glue (left, right);
+        }
+};
+
+/**** ASYNCHRONOUS UPDATES ****/
+// Selects what AsyncSegtree::RangeSum reads. LastFlush sees the tree as the
+// latest Flush (perhaps one still running) left it: every Assign made before
+// that Flush, possibly some that raced with it, and none made after it
+// returned. ForceFlush runs a Flush first, so it sees every Assign made
+// before it.
+enum class ReadMode { LastFlush, ForceFlush };
+
+// Segtree whose Assign only pushes the request onto a queue, leaving the
+// walk to the root to a background applier thread. The queue is Vyukov's
+// intrusive MPSC queue: a push is one atomic exchange and one store, so
+// writers never wait on each other, the applier or readers. The applier
+// wakes every interval to drain the queue into a pending batch that keeps
+// only the last write to each index, but applies that batch with
+// AssignBatch only when a Flush asks for it, so the tree changes at flushes
+// alone. Readers share a lock that the applier holds only while applying,
+// and query through the const RangeSumShared, which writes nothing.
+template<typename ValueType, typename Monoid>
+class AsyncSegtree {
+    public:
+        AsyncSegtree(size_t size, Monoid monoid = Monoid(),
+                     chrono::microseconds interval = chrono::microseconds(1000))
+            : tree(size, monoid), interval(interval), head(&stub), tail(&stub),
+              applier([this] {Apply();}) {}
+
+        // Applies whatever is still queued and stops the applier.
+        ~AsyncSegtree() {
+            {
+                lock_guard<mutex> lock(sleep);
+                stopping = true;
+            }
+            wake.notify_one();
+            applier.join();
+            if (tail != &stub) delete tail;
+        }
+
+        // Queues an assignment of x to index i and returns without touching
+        // the tree. Safe to call from any number of threads.
+        void Assign(size_t i, ValueType x) {
+            Request* r = new Request{{nullptr}, i, std::move(x)};
+            Request* prev = head.exchange(r, memory_order_acq_rel);
+            prev->next.store(r, memory_order_release);
+            pushed.fetch_add(1, memory_order_release);
+        }
+
+        // Returns once every Assign that returned before the call has been
+        // applied to the tree.
+        void Flush() {
+            size_t target = pushed.load(memory_order_acquire);
+            if (applied.load(memory_order_acquire) >= target) return;
+            unique_lock<mutex> lock(sleep);
+            flush_target = max(flush_target, target);
+            wake.notify_one();
+            done.wait(lock, [&] {return applied.load(memory_order_acquire) >= target;});
+        }
+
+        // Finds sum_{i <= k <= j} A[k] with the guarantee chosen by mode.
+        ValueType RangeSum(size_t i, size_t j, ReadMode mode = ReadMode::LastFlush) {
+            if (mode == ReadMode::ForceFlush) Flush();
+            shared_lock<shared_mutex> lock(readers);
+            return tree.RangeSumShared(i, j);
+        }
+
+    private:
+        struct Request {
+            atomic<Request*> next;
+            size_t i;
+            ValueType x;
+        };
+
+        Segtree<ValueType, Monoid> tree;
+        shared_mutex readers;
+        chrono::microseconds interval;
+
+        // The queue: producers exchange head, the applier alone reads tail.
+        // tail is always a node whose value has already been taken.
+        Request stub{{nullptr}, 0, ValueType()};
+        atomic<Request*> head;
+        Request* tail;
+        atomic<size_t> pushed{0};
+        atomic<size_t> applied{0};  // requests whose writes are in the tree
+
+        mutex sleep;
+        condition_variable wake;  // signalled by Flush and the destructor
+        condition_variable done;  // signalled by the applier after a batch
+        size_t flush_target = 0;  // highest pushed count a Flush waits for
+        bool stopping = false;
+
+        thread applier;
+
+        // Takes the oldest request off the queue, or returns false if there
+        // is none yet. A push that has exchanged head but not yet linked its
+        // node is simply picked up on a later call.
+        bool Pop(pair<size_t, ValueType>& out) {
+            Request* next = tail->next.load(memory_order_acquire);
+            if (!next) return false;
+            out = {next->i, std::move(next->x)};
+            if (tail != &stub) delete tail;
+            tail = next;
+            return true;
+        }
+
+        void Apply() {
+            vector<pair<size_t, ValueType>> pending;
+            pair<size_t, ValueType> request;
+            size_t taken = 0;      // requests popped so far
+            size_t coalesced = 0;  // size of pending after the last Coalesce
+            for (;;) {
+                while (Pop(request)) {
+                    pending.push_back(std::move(request));
+                    taken++;
+                }
+                // Squash rewrites as they pile up, so that pending stays
+                // within about twice the number of distinct indices.
+                if (pending.size() > 2*coalesced + 64) {
+                    Coalesce(pending);
+                    coalesced = pending.size();
+                }
+                unique_lock<mutex> lock(sleep);
+                bool wanted = stopping || flush_target > applied.load(memory_order_relaxed);
+                if (wanted && taken > applied.load(memory_order_relaxed)) {
+                    lock.unlock();
+                    Coalesce(pending);
+                    {
+                        unique_lock<shared_mutex> write(readers);
+                        tree.AssignBatch(pending);
+                    }
+                    pending.clear();
+                    coalesced = 0;
+                    lock.lock();
+                    applied.store(taken, memory_order_release);
+                    done.notify_all();
+                    continue;
+                }
+                if (stopping && taken >= pushed.load()) return;
+                if (wanted) {
+                    // A push counted by the Flush sits behind one that has
+                    // exchanged head but not yet linked its node.
+                    lock.unlock();
+                    this_thread::yield();
+                    continue;
+                }
+                wake.wait_for(lock, interval, [&] {
+                    return stopping || flush_target > applied.load(memory_order_relaxed);
+                });
+            }
+        }
+
+        // Keeps only the last request for each index, in index order.
+        static void Coalesce(vector<pair<size_t, ValueType>>& batch) {
+            stable_sort(batch.begin(), batch.end(),
+                        [](const auto& a, const auto& b) {return a.first < b.first;});
+            size_t kept = 0;
+            for (size_t k = 0; k < batch.size(); k++) {
+                if (k+1 < batch.size() && batch[k+1].first == batch[k].first) continue;
+                batch[kept++] = std::move(batch[k]);
+            }
+            batch.resize(kept);
+        }
+};
+
+/**** NUMA SHARDED SEGTREE ****/
+// NUMA nodes and the CPUs in each, read once from /sys/devices/system/node.
+// Where that is missing, and on systems other than Linux, every CPU counts
+// as node 0 and threads are never pinned.
+class NumaTopology {
+    public:
+        static const NumaTopology& Get() {
+            static const NumaTopology topology;
+            return topology;
+        }
+
+        // Returns one more than the highest node id present.
+        size_t Nodes() const {return cpus.size();}
+
+        // Returns the node of the CPU the calling thread is running on.
+        int CurrentNode() const {
+#ifdef __linux__
+            int cpu = sched_getcpu();
+            return (cpu >= 0 && (size_t)cpu < node_of_cpu.size()) ? node_of_cpu[cpu] : 0;
+#else
+            return 0;
+#endif
+        }
+
+        // Runs f on a thread pinned to the CPUs of node and waits for it, so
+        // that memory f touches first is placed on that node.
+        template<typename F>
+        void OnNode(int node, F f) const {
+            thread worker([&] {
+#ifdef __linux__
+                if ((size_t)node < cpus.size() && !cpus[node].empty()) {
+                    cpu_set_t set;
+                    CPU_ZERO(&set);
+                    for (int cpu : cpus[node]) CPU_SET(cpu, &set);
+                    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+                }
+#else
+                (void)node;
+#endif
+                f();
+            });
+            worker.join();
+        }
+
+    private:
+        vector<vector<int>> cpus;
+        vector<int> node_of_cpu;
+
+        NumaTopology() {
+            for (int node = 0; node < 1024; node++) {
+                string path = "/sys/devices/system/node/node" + to_string(node) + "/cpulist";
+                FILE* file = fopen(path.c_str(), "r");
+                if (!file) continue;
+                cpus.resize(node+1);
+                // cpulist looks like "0-3,8-11"
+                int lo, hi;
+                while (fscanf(file, "%d", &lo) == 1) {
+                    hi = lo;
+                    int c = fgetc(file);
+                    if (c == '-' && fscanf(file, "%d", &hi) == 1) c = fgetc(file);
+                    for (int cpu = lo; cpu <= hi; cpu++) {
+                        cpus[node].push_back(cpu);
+                        if ((size_t)cpu >= node_of_cpu.size()) node_of_cpu.resize(cpu+1, 0);
+                        node_of_cpu[cpu] = node;
+                    }
+                    if (c != ',') break;
+                }
+                fclose(file);
+            }
+            if (cpus.empty()) cpus.resize(1);
+        }
+};
+
+// Segtree split into shards over consecutive ranges of [0,n), each shard
+// a Segtree whose nodes are allocated by a thread pinned to its NUMA node.
+// A small top tree over the shard totals is replicated on every node in
+// use, so RangeSum reads only the two edge shards plus the local replica.
+// placement[s] is the node of shard s, and its length the shard count; the
+// default puts one shard on each node. Assign only keeps a shard's memory
+// on its node: callers that want local writes as well should send index i
+// to a thread on NodeOf(i), e.g. one started through NumaTopology::OnNode.
+template<typename ValueType, typename Monoid>
+class ShardedSegtree {
+    public:
+        ShardedSegtree(size_t size, Monoid monoid = Monoid())
+            : ShardedSegtree(size, DefaultPlacement(), monoid) {}
+
+        ShardedSegtree(size_t size, vector<int> placement, Monoid monoid = Monoid())
+            : n(size), placement(std::move(placement)), monoid(monoid),
+              identity(monoid.identity())
+        {
+            if (this->placement.empty()) this->placement.push_back(0);
+            const NumaTopology& numa = NumaTopology::Get();
+            size_t count = this->placement.size();
+            // Power-of-two shards keep every shard root a plain aligned block.
+            shard_len = PowerOfTwoLayout::SuperCeiling(max<size_t>(1, (size + count - 1) / count));
+            shards.reserve(count);
+            for (size_t s = 0; s < count; s++) shards.emplace_back(0, monoid);
+            for (size_t s = 0; s < count; s++) {
+                numa.OnNode(this->placement[s], [&] {shards[s] = Shard(shard_len, monoid);});
+            }
+            size_t nodes = numa.Nodes();
+            for (int node : this->placement) nodes = max(nodes, (size_t)node + 1);
+            tops.reserve(nodes);
+            for (size_t node = 0; node < nodes; node++) tops.emplace_back(0, monoid);
+            for (int node : this->placement) {
+                if (tops[node].Size() == 0) {
+                    numa.OnNode(node, [&] {tops[node] = Shard(count, monoid);});
+                }
+            }
+        }
+
+        // Returns the number of elements.
+        size_t Size() const {return n;}
+
+        // Returns the shard holding index i and the node it lives on.
+        size_t ShardOf(size_t i) const {return i / shard_len;}
+        int NodeOf(size_t i) const {return placement[ShardOf(i)];}
+
+        // Assigns value x to index i, then copies the new shard total into
+        // every replica of the top tree.
+        void Assign(size_t i, ValueType x) {
+            size_t s = ShardOf(i);
+            shards[s].Assign(i % shard_len, std::move(x));
+            ValueType total = shards[s].Total();
+            for (Shard& top : tops) {
+                if (top.Size() > 0) top.Assign(s, total);
+            }
+        }
+
+        // Finds sum_{i <= k <= j} A[k] from the partial answers of the shards
+        // holding i and j and, for the shards between them, the top tree
+        // replica on node (by default the caller's node).
+        ValueType RangeSum(size_t i, size_t j, int node = -1) {
+            size_t si = ShardOf(i), sj = ShardOf(j);
+            if (si == sj) return shards[si].RangeSum(i % shard_len, j % shard_len);
+            ValueType sum = shards[si].RangeSum(i % shard_len, shard_len - 1);
+            if (si + 1 < sj) sum = monoid.combine(sum, Top(node).RangeSum(si + 1, sj - 1));
+            return monoid.combine(sum, shards[sj].RangeSum(0, j % shard_len));
+        }
+
+        size_t MemoryUsage() const {
+            size_t bytes = sizeof(*this) + placement.capacity() * sizeof(int);
+            for (const Shard& shard : shards) bytes += shard.MemoryUsage();
+            for (const Shard& top : tops) bytes += top.MemoryUsage();
+            return bytes;
+        }
+
+    private:
+        using Shard = Segtree<ValueType, Monoid>;
+
+        size_t n;
+        size_t shard_len;
+        vector<int> placement;
+        vector<Shard> shards;
+        vector<Shard> tops;  // tops[node] is empty unless a shard is on node
+        Monoid monoid;
+        ValueType identity;
+
+        static vector<int> DefaultPlacement() {
+            vector<int> placement;
+            const NumaTopology& numa = NumaTopology::Get();
+            for (size_t node = 0; node < numa.Nodes(); node++) placement.push_back((int)node);
+            return placement;
+        }
+
+        // Returns the top tree replica for node, falling back to any replica
+        // when node has none of its own.
+        Shard& Top(int node) {
+            if (node < 0) node = NumaTopology::Get().CurrentNode();
+            if ((size_t)node < tops.size() && tops[node].Size() > 0) return tops[node];
+            return tops[placement[0]];
+        }
+};
+
+/**** NODE ARENA ****/
+// Bump allocator for the pointer-based trees below. Nodes live in one
+// growing vector and refer to each other by 32-bit index, which keeps them
+// small and stays valid when the vector reallocates. Nodes are never freed
+// one at a time; the arena is only ever dropped or rebuilt as a whole.
+template<typename NodeType>
+class NodeArena {
+    public:
+        // Appends node and returns its index. node must not refer into
+        // the arena itself, since the vector may move.
+        uint32_t Allocate(const NodeType& node) {
+            nodes.push_back(node);
+            return (uint32_t)(nodes.size() - 1);
+        }
+
+        NodeType& operator[](uint32_t i) {return nodes[i];}
+        const NodeType& operator[](uint32_t i) const {return nodes[i];}
+
+        size_t Size() const {return nodes.size();}
+        void Reserve(size_t count) {nodes.reserve(count);}
+        size_t MemoryUsage() const {return nodes.capacity() * sizeof(NodeType);}
+
+    private:
+        vector<NodeType> nodes;
+};
+
+/**** PERSISTENT SEGTREE ****/
+// Segtree in which Assign leaves the tree it was given untouched and
+// returns a new version. Only the O(log n) nodes on the path from the root
+// to the assigned leaf are copied; every other node is shared with the old
+// version, so each version costs O(log n) extra memory instead of a full
+// copy of A. Nodes come from a NodeArena, and versions that are no longer
+// needed are released together by Retain.
+template<typename ValueType, typename Monoid>
+class PersistentSegtree {
+    public:
+        // A version is named by the arena index of its root.
+        using Version = uint32_t;
+
+        // Constructor for persistent segtrees. The first version holds the
+        // identity everywhere and takes O(log n) nodes.
+        PersistentSegtree(size_t size, Monoid monoid = Monoid())
+            : n(size), N(PowerOfTwoLayout::SuperCeiling(size)),
+              monoid(monoid), identity(monoid.identity())
+        {
+            MakeEmpty();
+            initial = empty.back();
+        }
+
+        // Builds the first version over the given leaves in O(n).
+        PersistentSegtree(vector<ValueType>&& leaves, Monoid monoid = Monoid())
+            : n(leaves.size()), N(PowerOfTwoLayout::SuperCeiling(leaves.size())),
+              monoid(monoid), identity(monoid.identity())
+        {
+            MakeEmpty();
+            arena.Reserve(arena.Size() + 2*n);
+            initial = Build(leaves, 0UL, N-1, countr_zero(N));
+        }
+
+        // Returns the version the tree was constructed with, or the all
+        // identity version if that has been released by Retain.
+        Version Initial() const {return initial;}
+
+        // Returns a new version equal to root except that index i holds x.
+        Version Assign(Version root, size_t i, ValueType x) {
+            SEGTREE_COUNT(stats.assigns++);
+            uint32_t path[64];
+            size_t depth = 0, l = 0, r = N-1;
+            for (uint32_t v = root; l < r; depth++) {
+                SEGTREE_COUNT(stats.nodes_visited++);
+                path[depth] = v;
+                size_t m = (l+r)/2;
+                if (i <= m) {
+                    v = arena[v].left;
+                    r = m;
+                } else {
+                    v = arena[v].right;
+                    l = m+1;
+                }
+            }
+            uint32_t child = arena.Allocate(Node{x, 0, 0});
+            for (size_t d = depth; d-- > 0; ) {
+                Node copy = arena[path[d]];
+                if ((i >> (depth-1-d)) & 1) copy.right = child;
+                else copy.left = child;
+                copy.value = glue (arena[copy.left].value, arena[copy.right].value);
+                child = arena.Allocate(copy);
+            }
+            return child;
+        }
+
+        // Finds sum_{i <= k <= j} A[k] as of version root.
+        ValueType RangeSum(Version root, size_t i, size_t j) const {
+#ifdef SEGTREE_STATS
+            // Versions may be read by several threads at once, so counted
+            // queries take turns; only stats builds pay for the lock.
+            lock_guard<mutex> lock(segtree_stats_mutex);
+            stats.queries++;
+#endif
+            return f (root, 0UL, (N-1), i, j);
+        }
+
+        // Releases every version except those in keep, by copying the nodes
+        // they can reach into a fresh arena. Returns the new names of the
+        // kept versions, in the same order; all older names become invalid.
+        vector<Version> Retain(span<const Version> keep) {
+            NodeArena<Node> fresh;
+            vector<uint32_t> moved(arena.Size(), None);
+            size_t height = countr_zero(N);
+            for (size_t h = 0; h < empty.size(); h++) {
+                empty[h] = Copy(fresh, moved, empty[h], h);
+            }
+            vector<Version> renamed;
+            for (Version v : keep) renamed.push_back(Copy(fresh, moved, v, height));
+            initial = (moved[initial] != None) ? moved[initial] : empty.back();
+            arena = std::move(fresh);
+            return renamed;
+        }
+
+        // Returns the number of nodes held across all live versions.
+        size_t NodeCount() const {return arena.Size();}
+
+        size_t MemoryUsage() const {
+            return sizeof(*this) + arena.MemoryUsage() + empty.capacity() * sizeof(uint32_t);
+        }
+
+#ifdef SEGTREE_STATS
+        // Returns the counters accumulated since construction or ResetStats.
+        const SegtreeStats& Stats() const {return stats;}
+        void ResetStats() {stats = SegtreeStats();}
+#endif
+
+    private:
+        struct Node {
+            ValueType value;
+            uint32_t left, right;
+        };
+
+        static constexpr uint32_t None = ~0u;
+
+        size_t n;
+        size_t N;
+        Monoid monoid;
+        ValueType identity;
+        NodeArena<Node> arena;
+        // empty[h] is the all identity subtree over 2^h leaves
+        vector<uint32_t> empty;
+        Version initial;
+#ifdef SEGTREE_STATS
+        mutable SegtreeStats stats;
+#endif
+
+        ValueType glue(ValueType a, ValueType b) const {
+            SEGTREE_COUNT(stats.glue_calls++);
+            return monoid.combine(a, b);
+        }
+
+        void MakeEmpty() {
+            empty.push_back(arena.Allocate(Node{identity, 0, 0}));
+            for (size_t h = 1; h <= (size_t)countr_zero(N); h++) {
+                empty.push_back(arena.Allocate(Node{identity, empty[h-1], empty[h-1]}));
+            }
+        }
+
+        // Builds the subtree of height h over [l,r], sharing the empty
+        // subtrees for blocks that lie entirely past the last leaf.
+        uint32_t Build(vector<ValueType>& leaves, size_t l, size_t r, size_t h) {
+            if (l >= n) return empty[h];
+            if (h == 0) return arena.Allocate(Node{leaves[l], 0, 0});
+            size_t m = (l+r)/2;
+            uint32_t left = Build(leaves, l, m, h-1);
+            uint32_t right = Build(leaves, m+1, r, h-1);
+            return arena.Allocate(Node{glue (arena[left].value, arena[right].value), left, right});
+        }
+
+        // Copies the subtree of height h at v into fresh, once per node, so
+        // that sharing between versions survives the copy.
+        uint32_t Copy(NodeArena<Node>& fresh, vector<uint32_t>& moved, uint32_t v, size_t h) {
+            if (moved[v] != None) return moved[v];
+            Node node = arena[v];
+            if (h > 0) {
+                node.left = Copy(fresh, moved, node.left, h-1);
+                node.right = Copy(fresh, moved, node.right, h-1);
+            }
+            return moved[v] = fresh.Allocate(node);
+        }
+
+        ValueType f (uint32_t v, size_t l, size_t r, size_t i, size_t j) const {
+        /*  Same descent as Segtree::f, following child indices instead of
+            computing them.
+        */
+            SEGTREE_COUNT(stats.nodes_visited++;
+                          stats.max_depth = max<uint64_t>(stats.max_depth,
+                              countr_zero(N) - countr_zero(r-l+1) + 1));
+            if (l==i && r==j) {
+                return arena[v].value;
+            } else {
+                size_t m = (l+r)/2; // split [l,r] into [l,m] [m+1,r]
+                SEGTREE_COUNT(stats.splits += (i <= m && j > m));
+                ValueType t1 = (i <= m) ? f (arena[v].left, l, m, i, (min(m,j))): identity;
+                ValueType t2 = (j > m) ? f (arena[v].right, (m+1), r, (max(i,(m+1))), j): identity;
+                return glue (t1, t2);
+            }
+        }
+};
+
+/**** SPARSE SEGTREE ****/
+// Segtree over a huge index space, e.g. 2^40 keys of which only a few
+// million are ever assigned. Nodes are created from a NodeArena the first
+// time an Assign passes through them, and a missing child stands for a
+// subtree that holds the identity everywhere. Memory is therefore about
+// (number of assigned indices) * log2(size) nodes, however large size is.
+template<typename ValueType, typename Monoid>
+class SparseSegtree {
+    public:
+        // Constructor for sparse segtrees. Only the root is allocated.
+        SparseSegtree(size_t size, Monoid monoid = Monoid())
+            : N(PowerOfTwoLayout::SuperCeiling(size)), monoid(monoid), identity(monoid.identity())
+        {
+            arena.Allocate(Node{identity, None, None});
+        }
+
+        // Assigns value x to index i, creating the missing nodes on the way
+        // down and recomputing the path on the way back up.
+        void Assign(size_t i, ValueType x) {
+            SEGTREE_COUNT(stats.assigns++);
+            uint32_t path[64];
+            size_t depth = 0, l = 0, r = N-1;
+            uint32_t v = 0;
+            for (; l < r; depth++) {
+                SEGTREE_COUNT(stats.nodes_visited++);
+                path[depth] = v;
+                size_t m = l + (r-l)/2; // same split as f
+                bool right = i > m;
+                uint32_t child = right ? arena[v].right : arena[v].left;
+                if (child == None) {
+                    child = arena.Allocate(Node{identity, None, None});
+                    if (right) arena[v].right = child;
+                    else arena[v].left = child;
+                }
+                v = child;
+                if (right) l = m+1;
+                else r = m;
+            }
+            arena[v].value = x;
+            while (depth-- > 0) {
+                Node& node = arena[path[depth]];
+                node.value = glue (Value(node.left), Value(node.right));
+            }
+        }
+
+        // Finds sum_{i <= k <= j} A[k]
+        ValueType RangeSum(size_t i, size_t j) const {
+#ifdef SEGTREE_STATS
+            // As in PersistentSegtree, const readers may run concurrently.
+            lock_guard<mutex> lock(segtree_stats_mutex);
+            stats.queries++;
+#endif
+            return f (0, 0UL, (N-1), i, j);
+        }
+
+        // Returns the number of nodes created so far.
+        size_t NodeCount() const {return arena.Size();}
+
+        size_t MemoryUsage() const {return sizeof(*this) + arena.MemoryUsage();}
+
+#ifdef SEGTREE_STATS
+        // Returns the counters accumulated since construction or ResetStats.
+        const SegtreeStats& Stats() const {return stats;}
+        void ResetStats() {stats = SegtreeStats();}
+#endif
+
+    private:
+        struct Node {
+            ValueType value;
+            uint32_t left, right;
+        };
+
+        static constexpr uint32_t None = ~0u;
+
+        size_t N;
+        Monoid monoid;
+        ValueType identity;
+        NodeArena<Node> arena;
+#ifdef SEGTREE_STATS
+        mutable SegtreeStats stats;
+#endif
+
+        ValueType glue(ValueType a, ValueType b) const {
+            SEGTREE_COUNT(stats.glue_calls++);
+            return monoid.combine(a, b);
+        }
+
+        ValueType Value(uint32_t v) const {
+            return (v == None) ? identity : arena[v].value;
+        }
+
+        ValueType f (uint32_t v, size_t l, size_t r, size_t i, size_t j) const {
+        /*  Same descent as Segtree::f, stopping early at missing subtrees.
+        */
+            if (v == None) {
+                return identity;
+            }
+            SEGTREE_COUNT(stats.nodes_visited++;
+                          stats.max_depth = max<uint64_t>(stats.max_depth,
+                              countr_zero(N) - countr_zero(r-l+1) + 1));
+            if (l==i && r==j) {
+                return arena[v].value;
+            } else {
+                size_t m = l + (r-l)/2; // split [l,r] into [l,m] [m+1,r]
+                SEGTREE_COUNT(stats.splits += (i <= m && j > m));
+                ValueType t1 = (i <= m) ? f (arena[v].left, l, m, i, (min(m,j))): identity;
+                ValueType t2 = (j > m) ? f (arena[v].right, (m+1), r, (max(i,(m+1))), j): identity;
+                return glue (t1, t2);
+            }
+        }
+};
+
+/**** COORDINATE COMPRESSION ****/
+// Dense Segtree over a set of arbitrary 64-bit keys that is known up front.
+// The keys are sorted and deduplicated, key k is stored at its rank, and
+// by default the tree uses CompactLayout, so memory is about twice the
+// number of distinct keys no matter how widely they are spread. Queries over
+// a key range [lo,hi] cover whichever of the keys fall inside it.
+template<typename ValueType, typename Monoid, typename Layout = CompactLayout>
+class CompressedSegtree {
+    public:
+        // Constructor for compressed segtrees over the given keys.
+        CompressedSegtree(vector<uint64_t> keys, Monoid monoid = Monoid())
+            : keys(Normalize(std::move(keys))), tree(this->keys.size(), monoid),
+              identity(monoid.identity()) {}
+
+        // Returns the number of distinct keys.
+        size_t Size() const {return keys.size();}
+
+        // Returns the number of keys less than key, i.e. the index of key if
+        // it is one of the keys. The search has no data dependent branches:
+        // each step moves base by half times the comparison result, so there
+        // is nothing to mispredict where std::lower_bound would guess wrong
+        // half the time.
+        size_t Index(uint64_t key) const {
+            size_t len = keys.size();
+            if (len == 0) return 0;
+            const uint64_t* base = keys.data();
+            while (len > 1) {
+                size_t half = len/2;
+                base += half * (base[half-1] < key);
+                len -= half;
+            }
+            return (base - keys.data()) + (*base < key);
+        }
+
+        // Returns true if key is one of the keys given at construction.
+        bool Contains(uint64_t key) const {
+            size_t i = Index(key);
+            return i < keys.size() && keys[i] == key;
+        }
+
+        // Assigns value x to key and returns true, or returns false and
+        // leaves the tree alone if key is not one of the keys.
+        bool Assign(uint64_t key, ValueType x) {
+            size_t i = Index(key);
+            if (i >= keys.size() || keys[i] != key) return false;
+            tree.Assign(i, std::move(x));
+            return true;
+        }
+
+        // Finds the glue of the values of every key k with lo <= k <= hi.
+        ValueType RangeSum(uint64_t lo, uint64_t hi) {
+            size_t i = Index(lo), j = Index(hi);
+            if (j < keys.size() && keys[j] == hi) j++;
+            if (i >= j) return identity;
+            return tree.RangeSum(i, j-1);
+        }
+
+        size_t MemoryUsage() const {
+            return sizeof(*this) + keys.capacity() * sizeof(uint64_t)
+                 + tree.MemoryUsage() - sizeof(tree);
+        }
+
+    private:
+        vector<uint64_t> keys;
+        Segtree<ValueType, Monoid, Layout> tree;
+        ValueType identity;
+
+        static vector<uint64_t> Normalize(vector<uint64_t> keys) {
+            sort(keys.begin(), keys.end());
+            keys.erase(unique(keys.begin(), keys.end()), keys.end());
+            keys.shrink_to_fit();
+            return keys;
+        }
+};
+
+/**** SEGTREE FOREST ****/
+// Many small segtrees of one fixed size sharing a single slab. Tree t
+// occupies the 2N-1 slots from t*(2N-1), holding heap nodes 1..2N-1 in
+// order, so a tree is one short contiguous run with no allocation or
+// malloc header of its own, and sweeping trees in index order streams
+// through memory. Trees are named by a 32-bit TreeId rather than a
+// pointer; freed ids are recycled by later calls to Add, and a bit per
+// tree records which ids are live so that none is handed out twice.
+template<typename ValueType, typename Monoid>
+class SegtreeForest {
+    public:
+        using TreeId = uint32_t;
+
+        // Constructor for forests of trees over size elements each, with
+        // room reserved for trees of them.
+        SegtreeForest(size_t size, size_t trees = 0, Monoid monoid = Monoid())
+            : n(size), N(PowerOfTwoLayout::SuperCeiling(size)), stride(2*N - 1),
+              monoid(monoid), identity(monoid.identity())
+        {
+            slab.reserve(trees * stride);
+        }
+
+        // Returns the id of a new tree whose elements are all the identity.
+        // The id belongs to the caller until it is passed to Remove; only
+        // ids returned by Add and not yet removed may be used.
+        TreeId Add() {
+            if (!free_ids.empty()) {
+                TreeId t = free_ids.back();
+                free_ids.pop_back();
+                fill_n(slab.begin() + t * stride, stride, identity);
+                live[t] = true;
+                return t;
+            }
+            slab.resize(slab.size() + stride, identity);
+            live.push_back(true);
+            return (TreeId)(slab.size() / stride - 1);
+        }
+
+        // Frees tree t, whose id may then be handed out again by Add, and
+        // returns true. Returns false and does nothing if t is not live,
+        // i.e. was never returned by Add or has already been removed.
+        bool Remove(TreeId t) {
+            if (t >= live.size() || !live[t]) return false;
+            live[t] = false;
+            free_ids.push_back(t);
+            return true;
+        }
+
+        // Returns the number of elements in each tree.
+        size_t Size() const {return n;}
+
+        // Returns the number of trees, counting removed ones not yet reused.
+        size_t Trees() const {return slab.size() / stride;}
+
+        // Assigns value x to index i of tree t and recomputes its ancestors.
+        void Assign(TreeId t, size_t i, ValueType x) {
+            SEGTREE_COUNT(stats.assigns++);
+            i = i+N;
+            Node(t, i) = x;
+            for (i = i/2; i > 0UL; i = i/2) {
+                SEGTREE_COUNT(stats.nodes_visited += 2; stats.glue_calls++);
+                Node(t, i) = monoid.combine(Node(t, 2*i), Node(t, 2*i+1));
+            }
+        }
+
+        // Finds sum_{i <= k <= j} of tree t with the bottom-up walk of
+        // Segtree::g.
+        ValueType RangeSum(TreeId t, size_t i, size_t j) {
+            SEGTREE_COUNT(stats.queries++);
+            ValueType left = identity, right = identity;
+            size_t l = i+N, r = j+N+1;
+            while (l < r) {
+                SEGTREE_COUNT(stats.nodes_visited += (l & 1) + (r & 1);
+                              stats.glue_calls += (l & 1) + (r & 1));
+                if (l & 1) left = monoid.combine(left, Node(t, l++));
+                if (r & 1) right = monoid.combine(Node(t, --r), right);
+                l = l/2;
+                r = r/2;
+            }
+            SEGTREE_COUNT(stats.glue_calls++);
+            return monoid.combine(left, right);
+        }
+
+        size_t MemoryUsage() const {
+            return sizeof(*this) + slab.capacity() * sizeof(ValueType)
+                 + free_ids.capacity() * sizeof(TreeId) + live.capacity() / 8;
+        }
+
+#ifdef SEGTREE_STATS
+        // Returns the counters accumulated since construction or ResetStats.
+        const SegtreeStats& Stats() const {return stats;}
+        void ResetStats() {stats = SegtreeStats();}
+#endif
+
+    private:
+        size_t n;
+        size_t N;
+        size_t stride;
+        vector<ValueType> slab;
+        vector<TreeId> free_ids;
+        vector<bool> live;  // live[t] is true from Add(t) until Remove(t)
+        Monoid monoid;
+        ValueType identity;
+#ifdef SEGTREE_STATS
+        SegtreeStats stats;
+#endif
+
+        // Returns heap node v of tree t. Node 0 is never read, so it is not
+        // stored and node v sits v-1 slots into the tree.
+        ValueType& Node(TreeId t, size_t v) {return slab[t * stride + v - 1];}
+};
+
+/**** MULTI-AGGREGATE SEGTREE ****/
+// One tree holding an aggregate per monoid over the same elements, e.g.
+// MultiSegtree<int, SumMonoid<int>, MinMonoid<int>, MaxMonoid<int>,
+// CountMonoid<int>>. Each aggregate has its own contiguous node array
+// (struct of arrays), and all of them share one heap index walk, so Assign
+// climbs a single root path and RangeSum answers every aggregate at once.
+// A leaf of aggregate k is the element itself, or lift(element) if that
+// monoid defines lift.
+template<typename ValueType, typename... Monoids>
+class MultiSegtree {
+    static constexpr size_t K = sizeof...(Monoids);
+
+    public:
+        // The aggregates of a range, in the order the monoids were given.
+        using Aggregates = array<ValueType, K>;
+
+        // Constructor for multi-aggregate segtrees of size elements, with
+        // every aggregate at its identity.
+        MultiSegtree(size_t size, Monoids... monoids)
+            : n(size), N(PowerOfTwoLayout::SuperCeiling(size)), monoids(monoids...)
+        {
+            ForEach([&](auto k) {A[k].assign(2*N, Identity<k>());});
+        }
+
+        MultiSegtree(size_t size) : MultiSegtree(size, Monoids()...) {}
+
+        // Builds the tree over the given leaves in O(n) per aggregate.
+        MultiSegtree(vector<ValueType>&& leaves, Monoids... monoids)
+            : monoids(monoids...)
+        {
+            Rebuild(std::move(leaves));
+        }
+
+        MultiSegtree(vector<ValueType>&& leaves)
+            : MultiSegtree(std::move(leaves), Monoids()...) {}
+
+        // Assigns value x to index i and recomputes every aggregate on the
+        // path up to the root, all in the same climb.
+        void Assign(size_t i, const ValueType& x) {
+            i = i+N;
+            ForEach([&](auto k) {A[k][i] = Lift<k>(x);});
+            for (i = i/2; i > 0UL; i = i/2) {
+                ForEach([&](auto k) {A[k][i] = Glue<k>(A[k][2*i], A[k][2*i+1]);});
+            }
+        }
+
+        // Replaces the contents of the tree with the given leaves and
+        // recomputes it one level at a time. Within a level each aggregate
+        // is a straight loop over its own array with no dependencies between
+        // iterations, which g++ -O3 vectorizes for the stock monoids.
+        void Rebuild(vector<ValueType>&& leaves) {
+            n = leaves.size();
+            N = PowerOfTwoLayout::SuperCeiling(n);
+            ForEach([&](auto k) {
+                A[k].assign(2*N, Identity<k>());
+                for (size_t t = 0; t < n; t++) A[k][N+t] = Lift<k>(leaves[t]);
+            });
+            for (size_t lo = N/2; lo > 0UL; lo = lo/2) {
+                ForEach([&](auto k) {
+                    ValueType* a = A[k].data();
+                    for (size_t v = lo; v < 2*lo; v++) a[v] = Glue<k>(a[2*v], a[2*v+1]);
+                });
+            }
+        }
+
+        // Finds every aggregate of A[i..j] in one bottom-up walk.
+        Aggregates RangeSum(size_t i, size_t j) {
+            Aggregates left, right;
+            ForEach([&](auto k) {left[k] = right[k] = Identity<k>();});
+            size_t l = i+N, r = j+N+1;
+            while (l < r) {
+                if (l & 1) {
+                    ForEach([&](auto k) {left[k] = Glue<k>(left[k], A[k][l]);});
+                    l++;
+                }
+                if (r & 1) {
+                    r--;
+                    ForEach([&](auto k) {right[k] = Glue<k>(A[k][r], right[k]);});
+                }
+                l = l/2;
+                r = r/2;
+            }
+            ForEach([&](auto k) {left[k] = Glue<k>(left[k], right[k]);});
+            return left;
+        }
+
+        size_t MemoryUsage() const {
+            size_t bytes = sizeof(*this);
+            for (const auto& a : A) bytes += a.capacity() * sizeof(ValueType);
+            return bytes;
+        }
+
+    private:
+        size_t n;
+        size_t N;
+        array<vector<ValueType>, K> A;
+        tuple<Monoids...> monoids;
+
+        // Calls f(integral_constant<size_t, k>()) for k = 0 .. K-1 in order.
+        template<typename F>
+        static void ForEach(F f) {
+            [&]<size_t... k>(index_sequence<k...>) {
+                (f(integral_constant<size_t, k>()), ...);
+            }(make_index_sequence<K>());
+        }
+
+        template<size_t k>
+        ValueType Identity() const {return get<k>(monoids).identity();}
+
+        template<size_t k>
+        ValueType Glue(const ValueType& a, const ValueType& b) const {
+            return get<k>(monoids).combine(a, b);
+        }
+
+        // Returns the leaf of aggregate k for element x.
+        template<size_t k>
+        ValueType Lift(const ValueType& x) const {
+            if constexpr (requires {get<k>(monoids).lift(x);}) {
+                return get<k>(monoids).lift(x);
+            } else {
+                return x;
+            }
+        }
+};
+
+/**** 2D SEGTREE ****/
+// Segtree over the rows x of an nx by ny grid whose nodes are themselves
+// Segtrees over y, for point updates and rectangle queries in O(log^2 n).
+// All 2NX * 2NY values live in one flat slab: outer node u owns the 2NY
+// slots from u*2NY, and rows[u] is a Segtree viewing them through
+// SliceStorage. Inner node k of outer node u glues the cells of u's rows
+// and k's columns, so the glue must be commutative, as for sum and max.
+template<typename ValueType, typename Monoid>
+class Segtree2D {
+    public:
+        // Constructor for grids of nx by ny cells, all the identity.
+        Segtree2D(size_t nx, size_t ny, Monoid monoid = Monoid())
+            : nx(nx), ny(ny), NX(PowerOfTwoLayout::SuperCeiling(nx)),
+              NY(PowerOfTwoLayout::SuperCeiling(ny)), monoid(monoid),
+              identity(monoid.identity()), A(4*NX*NY, identity)
+        {
+            MakeRows();
+        }
+
+        // Builds the grid from cells in row-major order, cells[x*ny + y], in
+        // O(nx*ny): every leaf row is built as a 1D tree, then each outer node
+        // glues its two children slot by slot.
+        Segtree2D(size_t nx, size_t ny, vector<ValueType>&& cells, Monoid monoid = Monoid())
+            : Segtree2D(nx, ny, monoid)
+        {
+            for (size_t x = 0; x < nx; x++) {
+                ValueType* row = Row(x+NX);
+                for (size_t y = 0; y < ny; y++) row[NY+y] = std::move(cells[x*ny + y]);
+                for (size_t k = NY-1; k > 0UL; k--) row[k] = monoid.combine(row[2*k], row[2*k+1]);
+            }
+            for (size_t u = NX-1; u > 0UL; u--) {
+                ValueType* row = Row(u);
+                const ValueType* a = Row(2*u);
+                const ValueType* b = Row(2*u+1);
+                for (size_t k = 1; k < 2*NY; k++) row[k] = monoid.combine(a[k], b[k]);
+            }
+        }
+
+        // The rows view the slab, so a copy would still point at the original.
+        Segtree2D(const Segtree2D&) = delete;
+        Segtree2D& operator=(const Segtree2D&) = delete;
+        Segtree2D(Segtree2D&&) = default;
+        Segtree2D& operator=(Segtree2D&&) = default;
+
+        // Assigns value v to cell (x, y). The leaf row updates its own path,
+        // then every outer ancestor re-glues just the inner path above y.
+        void Assign(size_t x, size_t y, ValueType v) {
+            size_t u = x+NX;
+            rows[u].Assign(y, std::move(v));
+            for (u = u/2; u > 0UL; u = u/2) {
+                ValueType* row = Row(u);
+                const ValueType* a = Row(2*u);
+                const ValueType* b = Row(2*u+1);
+                for (size_t k = y+NY; k > 0UL; k = k/2) row[k] = monoid.combine(a[k], b[k]);
+            }
+        }
+
+        // Finds the glue of every cell in [x1,x2] x [y1,y2], with the
+        // bottom-up walk of Segtree::g over x and a row query per node.
+        ValueType RangeSum(size_t x1, size_t y1, size_t x2, size_t y2) {
+            ValueType left = identity, right = identity;
+            size_t l = x1+NX, r = x2+NX+1;
+            while (l < r) {
+                if (l & 1) left = monoid.combine(left, rows[l++].RangeSum(y1, y2));
+                if (r & 1) right = monoid.combine(rows[--r].RangeSum(y1, y2), right);
+                l = l/2;
+                r = r/2;
+            }
+            return monoid.combine(left, right);
+        }
+
+        size_t MemoryUsage() const {
+            return sizeof(*this) + A.capacity() * sizeof(ValueType)
+                 + rows.capacity() * sizeof(Row1D);
+        }
+
+    private:
+        using Row1D = Segtree<ValueType, Monoid, PowerOfTwoLayout, SliceStorage<ValueType>>;
+
+        size_t nx, ny;
+        size_t NX, NY;
+        Monoid monoid;
+        ValueType identity;
+        vector<ValueType> A;
+        vector<Row1D> rows;
+
+        ValueType* Row(size_t u) {return A.data() + u * 2*NY;}
+
+        void MakeRows() {
+            rows.reserve(2*NX);
+            for (size_t u = 0; u < 2*NX; u++) {
+                rows.push_back(Row1D::Adopt(ny, SliceStorage<ValueType>(Row(u), 2*NY), monoid));
+            }
+        }
+};
+
+/**** ORDER STATISTICS ****/
+// Bit vector with constant time rank. Every 512 bits share one 64-bit count
+// of the ones before them, so rank costs at most 8 popcounts and the
+// counts add 12.5% to the bits themselves.
+class RankBitvector {
+    public:
+        RankBitvector(size_t size = 0) : blocks(size/512 + 1) {}
+
+        void Set(size_t i) {blocks[i/512].words[i/64 % 8] |= uint64_t(1) << (i%64);}
+
+        // Fills in the block counts; call once after the last Set.
+        void Seal() {
+            uint64_t ones = 0;
+            for (Block& block : blocks) {
+                block.rank = ones;
+                for (uint64_t word : block.words) ones += popcount(word);
+            }
+        }
+
+        // Returns the number of ones in positions [0,i).
+        size_t Rank1(size_t i) const {
+            const Block& block = blocks[i/512];
+            size_t w = i/64 % 8;
+            size_t ones = block.rank;
+            for (size_t k = 0; k < w; k++) ones += popcount(block.words[k]);
+            return ones + popcount(block.words[w] & ((uint64_t(1) << (i%64)) - 1));
+        }
+
+        size_t Rank0(size_t i) const {return i - Rank1(i);}
+
+        size_t MemoryUsage() const {return blocks.capacity() * sizeof(Block);}
+
+    private:
+        struct Block {
+            uint64_t rank = 0;
+            uint64_t words[8] = {};
+        };
+        vector<Block> blocks;
+};
+
+// Static wavelet matrix over the values of an array, for the order
+// statistics a glue cannot express: the k-th smallest value in [i,j] and
+// the number of values at most x there, each in O(log sigma) rank queries
+// where sigma is the number of distinct values. Values are replaced by
+// their rank among the distinct values, and level l holds bit l of every
+// rank, most significant first, with the array stably sorted by the bits
+// above. That is n log sigma bits plus RankBitvector's 12.5%, besides a
+// copy of the distinct values. ValueType only needs operator<.
+template<typename ValueType>
+class WaveletMatrix {
+    public:
+        // Builds the matrix over values in O(n log sigma), after an
+        // O(n log n) sort to rank them.
+        WaveletMatrix(vector<ValueType> values) : n(values.size()) {
+            sorted = values;
+            sort(sorted.begin(), sorted.end());
+            sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+            sorted.shrink_to_fit();
+            vector<uint32_t> cur(n), next(n);
+            for (size_t k = 0; k < n; k++) {
+                cur[k] = (uint32_t)(lower_bound(sorted.begin(), sorted.end(), values[k]) - sorted.begin());
+            }
+            size_t height = max<size_t>(1, bit_width(sorted.size() > 0 ? sorted.size() - 1 : 0));
+            levels.assign(height, RankBitvector(n));
+            zeros.assign(height, 0);
+            for (size_t h = 0; h < height; h++) {
+                uint32_t bit = uint32_t(1) << (height - 1 - h);
+                size_t z = 0;
+                for (size_t k = 0; k < n; k++) {
+                    if (cur[k] & bit) levels[h].Set(k);
+                    else next[z++] = cur[k];
+                }
+                zeros[h] = z;
+                for (size_t k = 0; k < n; k++) {
+                    if (cur[k] & bit) next[z++] = cur[k];
+                }
+                levels[h].Seal();
+                swap(cur, next);
+            }
+        }
+
+        // Returns the number of values.
+        size_t Size() const {return n;}
+
+        // Returns the k-th smallest of A[i..j], counting from k = 0.
+        // k must be less than j-i+1.
+        ValueType KthSmallest(size_t i, size_t j, size_t k) const {
+            size_t l = i, r = j+1;
+            size_t rank = 0;
+            for (size_t h = 0; h < levels.size(); h++) {
+                size_t zl = levels[h].Rank0(l), zr = levels[h].Rank0(r);
+                rank = 2*rank;
+                if (k < zr - zl) {
+                    l = zl;
+                    r = zr;
+                } else {
+                    k -= zr - zl;
+                    l = zeros[h] + (l - zl);
+                    r = zeros[h] + (r - zr);
+                    rank++;
+                }
+            }
+            return sorted[rank];
+        }
+
+        // Returns the number of k in [i,j] with A[k] <= x.
+        size_t CountAtMost(size_t i, size_t j, const ValueType& x) const {
+            size_t below = upper_bound(sorted.begin(), sorted.end(), x) - sorted.begin();
+            if (below >= sorted.size()) return j-i+1;
+            // Count the ranks in [i,j] that are less than below.
+            size_t l = i, r = j+1, count = 0;
+            for (size_t h = 0; h < levels.size(); h++) {
+                size_t zl = levels[h].Rank0(l), zr = levels[h].Rank0(r);
+                if (below >> (levels.size() - 1 - h) & 1) {
+                    count += zr - zl;
+                    l = zeros[h] + (l - zl);
+                    r = zeros[h] + (r - zr);
+                } else {
+                    l = zl;
+                    r = zr;
+                }
+            }
+            return count;
+        }
+
+        size_t MemoryUsage() const {
+            size_t bytes = sizeof(*this) + sorted.capacity() * sizeof(ValueType)
+                         + zeros.capacity() * sizeof(size_t);
+            for (const RankBitvector& level : levels) bytes += level.MemoryUsage();
+            return bytes;
+        }
+
+    private:
+        size_t n;
+        vector<ValueType> sorted;       // the distinct values, ascending
+        vector<RankBitvector> levels;   // levels[h] holds bit height-1-h
+        vector<size_t> zeros;           // number of zeros in each level
+};
+
+/**** FENWICK BACKEND ****/
+// Fenwick tree (binary indexed tree) with the Assign and RangeSum of
+// Segtree, for monoids that are commutative and invertible such as sums and
+// xors. It keeps the n leaves in n slots instead of 2N nodes, and both
+// operations are a single loop over the bits of the index. Slot k holds the
+// glue of the leaves (k & (k+1)) .. k, where k+1 has its lowest set bit
+// removed by each step of a prefix walk and added by each step of an update.
+template<typename ValueType, typename Monoid>
+    requires InvertibleMonoid<Monoid, ValueType>
+class FenwickSegtree {
+    public:
+        // Constructor for Fenwick trees of size elements, all the identity.
+        FenwickSegtree(size_t size, Monoid monoid = Monoid())
+            : n(size), A(size, monoid.identity()), monoid(monoid),
+              identity(monoid.identity()) {}
+
+        // Builds a Fenwick tree over the given leaves in O(n), reusing the
+        // vector's buffer.
+        FenwickSegtree(vector<ValueType>&& leaves, Monoid monoid = Monoid())
+            : monoid(monoid), identity(monoid.identity())
+        {
+            Rebuild(std::move(leaves));
+        }
+
+        template<input_iterator It>
+        FenwickSegtree(It first, It last, Monoid monoid = Monoid())
+            : FenwickSegtree(vector<ValueType>(first, last), monoid) {}
+
+        // Assigns value x to index i by adding the difference between x and
+        // the value stored there to every slot that covers i.
+        void Assign(size_t i, ValueType x) {
+            SEGTREE_COUNT(stats.assigns++);
+            ValueType delta = glue (x, monoid.inverse(Leaf(i)));
+            for (size_t k = i+1; k <= n; k += k & (~k + 1)) {
+                SEGTREE_COUNT(stats.nodes_visited++);
+                A[k-1] = glue (A[k-1], delta);
+            }
+        }
+
+        // Assigns every (i, x) pair in updates, as if by Assign(i, x) in order.
+        void AssignBatch(span<const pair<size_t, ValueType>> updates) {
+            for (const auto& [i, x] : updates) Assign(i, x);
+        }
+
+        // Replaces the contents of the tree with the given leaves, resizing it
+        // to leaves.size(), and pushes every slot into the one above it.
+        void Rebuild(vector<ValueType>&& leaves) {
+            n = leaves.size();
+            A = std::move(leaves);
+            for (size_t k = 1; k <= n; k++) {
+                size_t up = k + (k & (~k + 1));
+                if (up <= n) A[up-1] = glue (A[up-1], A[k-1]);
+            }
+        }
+
+        // Finds sum_{i <= k <= j} A[k] as the prefix up to j with the prefix
+        // before i taken back out. Indices past the end count as identity.
+        ValueType RangeSum(size_t i, size_t j) {
+            SEGTREE_COUNT(stats.queries++);
+            j = min(j+1, n);
+            if (i >= j) return identity;
+            return glue (Prefix(j), monoid.inverse(Prefix(i)));
+        }
+
+        size_t MemoryUsage() const {
+            return sizeof(*this) + A.capacity() * sizeof(ValueType);
+        }
+
+#ifdef SEGTREE_STATS
+        // Returns the counters accumulated since construction or ResetStats.
+        const SegtreeStats& Stats() const {return stats;}
+        void ResetStats() {stats = SegtreeStats();}
+#endif
+
+    private:
+        size_t n;
+        vector<ValueType> A;
+        Monoid monoid;
+        ValueType identity;
+#ifdef SEGTREE_STATS
+        SegtreeStats stats;
+#endif
+
+        // Glues two elements together with the monoid's operator
+        ValueType glue(ValueType a, ValueType b) {
+            SEGTREE_COUNT(stats.glue_calls++);
+            return monoid.combine(a, b);
+        }
+
+        // Returns the glue of the first k leaves.
+        ValueType Prefix(size_t k) {
+            ValueType acc = identity;
+            for (; k > 0; k &= k-1) {
+                SEGTREE_COUNT(stats.nodes_visited++);
+                acc = glue (acc, A[k-1]);
+            }
+            return acc;
+        }
+
+        // Returns leaf i by taking the slots below it out of slot i, which
+        // is cheaper than the two prefix walks of RangeSum(i, i).
+        ValueType Leaf(size_t i) {
+            size_t k = i+1;
+            ValueType acc = A[i];
+            for (size_t j = k-1, stop = k & (k-1); j > stop; j &= j-1) {
+                SEGTREE_COUNT(stats.nodes_visited++);
+                acc = glue (acc, monoid.inverse(A[j-1]));
+            }
+            return acc;
+        }
+};
+
+// The point-update range-query tree to use for a monoid: FenwickSegtree
+// when the monoid declares an inverse and Segtree otherwise. Code written
+// against PointSegtree<V, M> switches backend with the monoid alone.
+template<typename ValueType, typename Monoid>
+struct PointSegtreeFor {using type = Segtree<ValueType, Monoid>;};
+
+template<typename ValueType, typename Monoid>
+    requires InvertibleMonoid<Monoid, ValueType>
+struct PointSegtreeFor<ValueType, Monoid> {using type = FenwickSegtree<ValueType, Monoid>;};
+
+template<typename ValueType, typename Monoid>
+using PointSegtree = typename PointSegtreeFor<ValueType, Monoid>::type;
+
+/**** SLIDING WINDOW ****/
+// The last W values of a stream, kept in a ring of W slots over a Segtree
+// so that Push overwrites the oldest slot with one Assign. Sums are glued
+// from oldest to newest, splitting at the wraparound, so the glue need not
+// commute. For invertible monoids WindowSum is a running total updated in
+// O(1) per event. Otherwise, as for min or max, it is cached only until the
+// next Push, so a WindowSum after every Push costs O(log W) each time.
+template<typename ValueType, typename Monoid>
+class WindowSegtree {
+    public:
+        // Constructor for windows over the last window values. Throws
+        // invalid_argument if window is 0, so Window() is always at least 1.
+        WindowSegtree(size_t window, Monoid monoid = Monoid())
+            : window(window), tree(window, monoid), monoid(monoid),
+              identity(monoid.identity()), running(identity), cached(identity)
+        {
+            if (window == 0) throw invalid_argument("WindowSegtree: window must be at least 1");
+        }
+
+        // Returns the number of values in the window, at most Window().
+        size_t Size() const {return count;}
+        size_t Window() const {return window;}
+
+        // Appends x to the stream, dropping the oldest value once the window
+        // is full.
+        void Push(ValueType x) {
+            if constexpr (InvertibleMonoid<Monoid, ValueType>) {
+                if (count == window) running = monoid.combine(running, monoid.inverse(tree.Leaf(head)));
+                running = monoid.combine(running, x);
+            }
+            tree.Assign(head, std::move(x));
+            head = (head + 1 == window) ? 0 : head + 1;
+            count = min(count + 1, window);
+            fresh = false;
+        }
+
+        // Returns the glue of every value in the window, oldest first.
+        ValueType WindowSum() {
+            if constexpr (InvertibleMonoid<Monoid, ValueType>) {
+                return running;
+            } else {
+                if (!fresh) {
+                    cached = RecentSum(count);
+                    fresh = true;
+                }
+                return cached;
+            }
+        }
+
+        // Returns the glue of the k most recent values, oldest first.
+        ValueType RecentSum(size_t k) {
+            k = min(k, count);
+            if (k == 0) return identity;
+            // The k values end just before head and may wrap past slot 0.
+            if (k <= head) return tree.RangeSum(head - k, head - 1);
+            ValueType older = tree.RangeSum(window - (k - head), window - 1);
+            return (head == 0) ? older : monoid.combine(older, tree.RangeSum(0, head - 1));
+        }
+
+        size_t MemoryUsage() const {
+            return sizeof(*this) + tree.MemoryUsage() - sizeof(tree);
+        }
+
+    private:
+        size_t window;
+        size_t head = 0;   // slot the next Push writes
+        size_t count = 0;
+        Segtree<ValueType, Monoid> tree;
+        Monoid monoid;
+        ValueType identity;
+        ValueType running;  // window total, kept for invertible monoids
+        ValueType cached;   // WindowSum as of the last Push, if fresh
+        bool fresh = true;
+};
+
+#ifdef SEGTREE_BENCHMARK
+#include "segtree_bench.h"
+
+template<typename Tree>
+void BenchTree(const char* name, size_t max_log, size_t ops) {
+    BenchSuite(name, [](vector<int>&& v) {return Tree(std::move(v));}, max_log, ops);
+}
+
+int main(int argc, char** argv) {
+    size_t max_log, ops;
+    BenchHeader(argc, argv, max_log, ops);
+    BenchTree<Segtree<int, SumMonoid<int>>>("Segtree/PowerOfTwo", max_log, ops);
+    BenchTree<Segtree<int, SumMonoid<int>, CompactLayout>>("Segtree/Compact", max_log, ops);
+    BenchSuite("Segtree/Precomputed", [](vector<int>&& v) {
+        return Segtree<int, SumMonoid<int>>(std::move(v), SumMonoid<int>(), QueryEngine::Precomputed);
+    }, max_log, ops);
+    BenchSuite("Segtree/Function", [](vector<int>&& v) {
+        return Segtree<int>(std::move(v), FunctionMonoid<int>(plus<int>()));
+    }, max_log, ops);
+    BenchTree<WideSegtree<int, SumMonoid<int>>>("WideSegtree", max_log, ops);
+    BenchTree<FenwickSegtree<int, SumMonoid<int>>>("FenwickSegtree", max_log, ops);
+    return 0;
+}
+#else
+int main() {
+    Segtree<int> s(7, plus<int>());
+    s.Assign(3,7);
+    s.Assign(4,1);
+
+    s.printA();
+    
+    printf(" RangeSum(2,7) = %d\n", s.RangeSum(2,7));
+    printf(" RangeSum(0,3) = %d\n", s.RangeSum(0,3));
+    printf(" RangeSum(4,5) = %d\n", s.RangeSum(4,5));
+    printf(" RangeSum(5,5) = %d\n", s.RangeSum(5,5));
+
+    // Untouched leaves hold the identity, so they never win a minimum.
+    Segtree<int, MinMonoid<int>> m(7);
+    m.Assign(3,7);
+    m.Assign(4,1);
+    printf(" RangeMin(0,3) = %d\n", m.RangeSum(0,3));
+    printf(" RangeMin(2,6) = %d\n", m.RangeSum(2,6));
+
+    LazySegtree<int, SumMonoid<int>, AddToSum<int>> z(7);
+    z.Assign(3,7);
+    z.RangeUpdate(1,5,2);
+    printf(" RangeSum(0,3) after adding 2 to [1,5] = %d\n", z.RangeSum(0,3));
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -2,20 +2,67 @@
  *  @author Danny Sleator, translated by Abi Kim (abigalek)
  *  @brief Segment tree implementation in C++. 
  *  Implements the segtree described in the lectures notes.
+ *  Needs C++20: g++ -std=c++20 segtree.cpp
+ *  Add -DSEGTREE_BENCHMARK to build the benchmark in segtree_bench.h,
+ *  and -DSEGTREE_STATS to count the work each operation does.
  */ 
 
 
 #include <algorithm>
+#include <bit>
+#include <cstdint>
 #include <iostream>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <utility>
 #include <vector>
 
 using namespace std;
 
+// Selects how RangeSum walks the tree: Recursive is the top-down descent f
+// from the lecture notes, Iterative is the bottom-up loop g.
+enum class QueryEngine { Recursive, Iterative };
+
+/**** STATISTICS ****/
+// With -DSEGTREE_STATS the Segtree counts the work its operations do,
+// readable through Stats() and cleared by ResetStats(), the same counters
+// as in generic_segtree.cpp. Without it they are compiled out.
+struct SegtreeStats {
+    uint64_t assigns = 0;        // Assign calls
+    uint64_t queries = 0;        // RangeSum calls, including those in batches
+    uint64_t glue_calls = 0;     // calls of glue
+    uint64_t nodes_visited = 0;  // nodes a walk reads or, for f, calls on
+    uint64_t splits = 0;         // calls of f that recurse into both children
+    uint64_t max_depth = 0;      // deepest call of f, the root being depth 1
+
+    SegtreeStats& operator+=(const SegtreeStats& other) {
+        assigns += other.assigns;
+        queries += other.queries;
+        glue_calls += other.glue_calls;
+        nodes_visited += other.nodes_visited;
+        splits += other.splits;
+        max_depth = max(max_depth, other.max_depth);
+        return *this;
+    }
+};
+
+#ifdef SEGTREE_STATS
+#define SEGTREE_COUNT(...) do {__VA_ARGS__;} while (0)
+// Guards merging the counters of RangeSumBatch worker threads.
+inline mutex segtree_stats_mutex;
+#else
+#define SEGTREE_COUNT(...) do {} while (0)
+#endif
+
 class Segtree {
     public:
         // Constructor for segtrees.
-        Segtree(size_t size) {
+        // The query engine defaults to the iterative bottom-up walk; pass
+        // QueryEngine::Recursive to use the top-down descent f instead.
+        Segtree(size_t size, QueryEngine engine = QueryEngine::Iterative) {
             n = size;
+            this->engine = engine;
             N = SuperCeiling(size);
             A.resize(2 * N, identity);
         }
@@ -25,19 +72,52 @@ class Segtree {
         // every other value in the path up to the root from index i by 
         // adding together the values of the two children below it.
         void Assign(size_t i, int x) {
+            SEGTREE_COUNT(stats.assigns++);
             i = i+N;
             A[i] = x;
             for (i = Parent(i); i>0UL; i = Parent(i)) {
+                SEGTREE_COUNT(stats.nodes_visited += 2);
                 A[i] = glue (A[LeftChild(i)], A[RightChild(i)]);
             }
         }
 
         // Finds sum_{i <= k <= j} A[k]
-        // More information in function f's documentation.
+        // More information in the documentation of f and g.
         int RangeSum(size_t i, size_t j) {
-            return f (1UL, 0UL, (N-1), i, j);
+            SEGTREE_COUNT(stats.queries++);
+            if (engine == QueryEngine::Recursive) {
+                return f (1UL, 0UL, (N-1), i, j);
+            }
+            return g (i, j);
         }
 
+        // Answers a batch of independent queries: out[k] = RangeSum(i, j) for
+        // each queries[k] = (i, j). With threads > 1 the batch is split into
+        // contiguous chunks that are answered in parallel; the tree must not
+        // be modified until the call returns.
+        void RangeSumBatch(span<const pair<size_t, size_t>> queries, span<int> out,
+                           size_t threads = 1) {
+            if (threads <= 1 || queries.size() < 2*threads) {
+                h (queries, out);
+                return;
+            }
+            vector<thread> workers;
+            size_t chunk = (queries.size() + threads - 1) / threads;
+            for (size_t lo = 0; lo < queries.size(); lo += chunk) {
+                size_t len = min(chunk, queries.size() - lo);
+                workers.emplace_back([this, queries, out, lo, len] {
+                    h (queries.subspan(lo, len), out.subspan(lo, len));
+                });
+            }
+            for (thread& w : workers) w.join();
+        }
+
+#ifdef SEGTREE_STATS
+        // Returns the counters accumulated since construction or ResetStats.
+        const SegtreeStats& Stats() const {return stats;}
+        void ResetStats() {stats = SegtreeStats();}
+#endif
+
         // Prints the contents of the array A
         void printA() {
             for (size_t i=0; i < 2*N; i++) {
@@ -48,8 +128,12 @@ class Segtree {
     private:
         size_t n;
         size_t N;
+        QueryEngine engine;
         vector<int> A;
         int identity = 0;
+#ifdef SEGTREE_STATS
+        SegtreeStats stats;
+#endif
 
         // Returns smallest power of 2 greater than equal to n
         size_t SuperCeiling(size_t n) {
@@ -65,6 +149,7 @@ class Segtree {
 
         // Function that glues associative operator on elements
         int glue(int a, int b) {
+            SEGTREE_COUNT(stats.glue_calls++);
             return a+b;
         }
 
@@ -78,17 +163,113 @@ class Segtree {
         */
             int t1, t2;
             size_t m;
+            SEGTREE_COUNT(stats.nodes_visited++;
+                          stats.max_depth = max<uint64_t>(stats.max_depth, bit_width(v)));
             if (l==i && r==j) {
                 return A[v];
             } else {
                 m = (l+r)/2; // split [l,r] into [l,m] [m+1,r]
+                SEGTREE_COUNT(stats.splits += (i <= m && j > m));
                 t1 = (i <= m) ? f (LeftChild(v), l, m, i, (min(m,j))): identity;
                 t2 = (j > m) ? f (RightChild(v), (m+1), r, (max(i,(m+1))), j): identity;
                 return glue (t1, t2);
             }
         }
+
+        int g (size_t i, size_t j) {
+        /*  Iterative version of f that walks up from the leaves instead of
+            descending from the root.
+            The half-open range [l,r) holds the nodes still to be added in.
+            Whenever l is a right child, A[l] lies entirely inside the query
+            and is glued onto the left accumulator; likewise for r-1 being a
+            left child and the right accumulator. Keeping the two sides apart
+            preserves the order of the operands, so glue need not commute.
+        */
+            int left = identity, right = identity;
+            size_t l = i+N, r = j+N+1;
+            while (l < r) {
+                SEGTREE_COUNT(stats.nodes_visited += (l & 1) + (r & 1));
+                if (l & 1) left = glue (left, A[l++]);
+                if (r & 1) right = glue (A[--r], right);
+                l = Parent(l);
+                r = Parent(r);
+            }
+            return glue (left, right);
+        }
+
+        // Number of queries whose walks RangeSumBatch runs side by side.
+        static constexpr size_t Interleave = 8;
+
+        void h (span<const pair<size_t, size_t>> queries, span<int> out) {
+        /*  Runs g for up to Interleave queries at once, advancing each of
+            them by one level per round. The loads of different queries do
+            not depend on each other, so their cache misses overlap instead
+            of being paid one after another on trees larger than the cache.
+        */
+            size_t l[Interleave], r[Interleave];
+            vector<int> left(Interleave, identity), right(Interleave, identity);
+            // h may run on several threads at once, so it counts into a local
+            // copy that is merged once at the end rather than through glue.
+#ifdef SEGTREE_STATS
+            SegtreeStats local;
+            local.queries = queries.size();
+#endif
+            auto combine = [&](int a, int b) {
+                SEGTREE_COUNT(local.glue_calls++);
+                return a+b;
+            };
+            for (size_t base = 0; base < queries.size(); base += Interleave) {
+                size_t k = min(Interleave, queries.size() - base);
+                for (size_t t = 0; t < k; t++) {
+                    l[t] = queries[base+t].first+N;
+                    r[t] = queries[base+t].second+N+1;
+                    left[t] = right[t] = identity;
+                }
+                for (bool active = true; active; ) {
+                    active = false;
+                    for (size_t t = 0; t < k; t++) {
+                        if (l[t] >= r[t]) continue;
+                        SEGTREE_COUNT(local.nodes_visited += (l[t] & 1) + (r[t] & 1));
+                        if (l[t] & 1) left[t] = combine (left[t], A[l[t]++]);
+                        if (r[t] & 1) right[t] = combine (A[--r[t]], right[t]);
+                        l[t] = Parent(l[t]);
+                        r[t] = Parent(r[t]);
+                        active = true;
+                    }
+                }
+                for (size_t t = 0; t < k; t++) {
+                    out[base+t] = combine (left[t], right[t]);
+                }
+            }
+#ifdef SEGTREE_STATS
+            lock_guard<mutex> lock(segtree_stats_mutex);
+            stats += local;
+#endif
+        }
 };
 
+#ifdef SEGTREE_BENCHMARK
+#include "segtree_bench.h"
+
+// There is no bulk constructor, so build times n calls to Assign.
+Segtree BenchBuild(vector<int>&& leaves, QueryEngine engine) {
+    Segtree s(leaves.size(), engine);
+    for (size_t k = 0; k < leaves.size(); k++) s.Assign(k, leaves[k]);
+    return s;
+}
+
+int main(int argc, char** argv) {
+    size_t max_log, ops;
+    BenchHeader(argc, argv, max_log, ops);
+    BenchSuite("Segtree/Iterative", [](vector<int>&& v) {
+        return BenchBuild(std::move(v), QueryEngine::Iterative);
+    }, max_log, ops);
+    BenchSuite("Segtree/Recursive", [](vector<int>&& v) {
+        return BenchBuild(std::move(v), QueryEngine::Recursive);
+    }, max_log, ops);
+    return 0;
+}
+#else
 int main() {
     Segtree s(7);
     s.Assign(3,7);
@@ -101,4 +282,5 @@ int main() {
     printf(" RangeSum(4,5) = %d\n", s.RangeSum(4,5));
     printf(" RangeSum(5,5) = %d\n", s.RangeSum(5,5));
     return 0;
-}
\ No newline at end of file
+}
+#endif
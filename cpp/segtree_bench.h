@@ -0,0 +1,153 @@
+/** @file segtree_bench.h
+ *  @brief Self-contained microbenchmark harness for the C++ segtrees.
+ *  Included by segtree.cpp and generic_segtree.cpp when they are built
+ *  with -DSEGTREE_BENCHMARK, in which case their demo main is replaced by
+ *  one that runs BenchSuite over each tree variant, e.g.
+ *    g++ -std=c++20 -O2 -DSEGTREE_BENCHMARK generic_segtree.cpp -lpthread
+ *    ./a.out [max log2 size] [ops per cell]
+ *  c/segtree.c carries the same harness written in C.
+ *
+ *  For every tree size and access pattern a suite times three operations:
+ *    build     constructing the tree over n leaves, in ns per leaf
+ *    assign    Assign at indices drawn from the pattern
+ *    rangesum  RangeSum over [a, a+len] with a drawn from the pattern and
+ *              len uniform in what is left of the array
+ *  and prints throughput plus p50/p90/p99 latency. The clock costs about
+ *  as much as one small operation, so latencies are the mean of batches of
+ *  BenchBatch operations rather than of single calls.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <utility>
+#include <vector>
+
+// Sizes as numbers of int leaves, chosen so that the 2N node array of a
+// power-of-two tree fits L1 (16 KB), L2 (256 KB), L3 (4 MB) or only DRAM
+// (64 MB) on a typical x86 core.
+inline std::vector<size_t> BenchSizes(size_t max_log) {
+    std::vector<size_t> sizes;
+    for (size_t log : {11, 15, 19, 23}) {
+        if (log <= max_log) sizes.push_back(size_t(1) << log);
+    }
+    return sizes;
+}
+
+enum class BenchAccess { Uniform, Zipf, Sequential };
+
+constexpr BenchAccess BenchPatterns[] = {BenchAccess::Uniform, BenchAccess::Zipf,
+                                         BenchAccess::Sequential};
+
+inline const char* BenchAccessName(BenchAccess access) {
+    switch (access) {
+        case BenchAccess::Uniform: return "uniform";
+        case BenchAccess::Zipf: return "zipf";
+        default: return "sequential";
+    }
+}
+
+// Returns count indices in [0,n). Zipf draws rank r with probability about
+// 1/(r+1) by inverting the continuous CDF, then scatters ranks with a
+// multiplicative hash so that the hot indices are not also neighbours.
+inline std::vector<size_t> BenchIndices(BenchAccess access, size_t n, size_t count,
+                                        unsigned seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::vector<size_t> idx(count);
+    for (size_t k = 0; k < count; k++) {
+        switch (access) {
+            case BenchAccess::Uniform:
+                idx[k] = rng() % n;
+                break;
+            case BenchAccess::Zipf: {
+                size_t rank = (size_t)std::exp(unit(rng) * std::log((double)n + 1)) - 1;
+                idx[k] = (std::min(rank, n-1) * 0x9E3779B97F4A7C15ULL) % n;
+                break;
+            }
+            case BenchAccess::Sequential:
+                idx[k] = k % n;
+                break;
+        }
+    }
+    return idx;
+}
+
+constexpr size_t BenchBatch = 32;
+
+// Accumulates query results so that the compiler cannot drop them.
+inline volatile long long bench_sink = 0;
+
+// Throughput and batch latency percentiles of one timed loop.
+struct BenchResult {
+    double mops;
+    double p50, p90, p99;
+};
+
+// Times op(k) for k in [0,count) in batches of BenchBatch.
+template<typename Op>
+BenchResult BenchTime(size_t count, Op op) {
+    std::vector<double> batches;
+    batches.reserve(count / BenchBatch + 1);
+    double total = 0;
+    for (size_t k = 0; k < count; k += BenchBatch) {
+        size_t end = std::min(count, k + BenchBatch);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t t = k; t < end; t++) op(t);
+        auto stop = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+        total += ns;
+        batches.push_back(ns / (end - k));
+    }
+    std::sort(batches.begin(), batches.end());
+    auto at = [&](double q) {return batches[(size_t)(q * (batches.size() - 1))];};
+    return {count / total * 1e3, at(0.50), at(0.90), at(0.99)};
+}
+
+inline void BenchPrint(const char* name, const char* op, const char* access, size_t n,
+                       BenchResult r) {
+    printf("%-22s %-8s %-10s n=%-9zu %8.2f Mops/s  p50 %7.1f  p90 %7.1f  p99 %7.1f ns\n",
+           name, op, access, n, r.mops, r.p50, r.p90, r.p99);
+}
+
+inline void BenchHeader(int argc, char** argv, size_t& max_log, size_t& ops) {
+    max_log = (argc > 1) ? strtoul(argv[1], nullptr, 10) : 23;
+    ops = (argc > 2) ? strtoul(argv[2], nullptr, 10) : (size_t(1) << 18);
+    printf("# ops per cell %zu, latency is the mean of %zu-op batches\n", ops, BenchBatch);
+}
+
+// Runs the whole grid for one tree type. make(leaves) must build a tree
+// over the given leaves; the tree needs Assign(i, int) and RangeSum(i, j).
+template<typename Make>
+void BenchSuite(const char* name, Make make, size_t max_log, size_t ops) {
+    for (size_t n : BenchSizes(max_log)) {
+        std::vector<int> leaves(n, 1);
+        size_t builds = std::max<size_t>(1, ops / n);
+        BenchResult build = BenchTime(builds, [&](size_t) {
+            auto tree = make(std::vector<int>(leaves));
+            bench_sink = bench_sink + tree.RangeSum(0, n-1);
+        });
+        double per_leaf = 1e3 / build.mops / n;
+        printf("%-22s %-8s %-10s n=%-9zu %8.2f ns/leaf\n", name, "build", "-", n, per_leaf);
+
+        auto tree = make(std::vector<int>(leaves));
+        for (BenchAccess access : BenchPatterns) {
+            std::vector<size_t> idx = BenchIndices(access, n, ops, (unsigned)n);
+            std::vector<size_t> len = BenchIndices(BenchAccess::Uniform, n, ops, (unsigned)n + 1);
+            BenchResult assign = BenchTime(ops, [&](size_t k) {
+                tree.Assign(idx[k], (int)k);
+            });
+            BenchPrint(name, "assign", BenchAccessName(access), n, assign);
+            long long sum = 0;
+            BenchResult query = BenchTime(ops, [&](size_t k) {
+                size_t a = idx[k];
+                sum += tree.RangeSum(a, a + len[k] % (n - a));
+            });
+            bench_sink = bench_sink + sum;
+            BenchPrint(name, "rangesum", BenchAccessName(access), n, query);
+        }
+    }
+}